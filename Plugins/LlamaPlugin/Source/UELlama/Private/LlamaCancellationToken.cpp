@@ -0,0 +1,18 @@
+﻿// Copyright 2023 Isara Technologies SAS. All Rights Reserved.
+
+#include "LlamaCancellationToken.h"
+
+ULlamaCancellationToken* ULlamaCancellationToken::CreateCancellationToken()
+{
+	return NewObject<ULlamaCancellationToken>();
+}
+
+void ULlamaCancellationToken::Cancel()
+{
+	Cancellation->Cancel();
+}
+
+bool ULlamaCancellationToken::IsCancelled() const
+{
+	return Cancellation->IsCancelled();
+}
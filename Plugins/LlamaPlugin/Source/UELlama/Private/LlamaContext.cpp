@@ -0,0 +1,641 @@
+﻿// Copyright 2023 Isara Technologies SAS. All Rights Reserved.
+
+#include "LlamaContext.h"
+
+#include "HAL/FileManager.h"
+#include "LlamaContextHandler.h"
+#include "LlamaSettings.h"
+#include "Misc/Compression.h"
+#include "Misc/FileHelper.h"
+#include "Misc/Paths.h"
+#include "Serialization/BufferArchive.h"
+#include "Serialization/MemoryReader.h"
+
+// Version of the file saved next to the llama session file. Version 2 adds the turn checkpoints and whether the history ends with an answer.
+static constexpr int32 ConversationVersion = 2;
+
+// The part of a turn checkpoint written in a save. The ring position of the sampler is rebuilt when loading.
+static void SerializeCheckpoint(FArchive& Archive, FLlamaTurnCheckpoint& Checkpoint)
+{
+	Archive << Checkpoint.NPast;
+	for (int i = 0; i < 2; i++)
+	{
+		Archive << Checkpoint.Sampler.MirostatMu[i];
+		Archive << Checkpoint.Sampler.bMirostatInitialized[i];
+	}
+}
+
+// The llama session file (tokens and KV cache) and the file with everything else
+static FString GetConversationPath(const FString& SlotName, const TCHAR* Extension)
+{
+	return FPaths::Combine(FPaths::ProjectSavedDir(), TEXT("SaveGames"), TEXT("Llama"), SlotName + Extension);
+}
+
+ULlamaContext::~ULlamaContext()
+{
+	// A context collected without FreeContext must not stay in the handler's list
+	ULlamaContextHandler::UnlistContext(this);
+
+	stop = true;
+	FRWScopeLock ContextLock = FRWScopeLock(WriteLock, SLT_Write);
+	if (this && !isUnloaded)
+	{
+		isUnloaded = true;
+		ReleaseLlamaContext();
+		UE_LOG(LogTemp, Warning, TEXT("[LLama Integration] A Context was unloaded !"));
+	}
+
+	DiscardSnapshot();
+}
+
+void ULlamaContext::ReleaseLlamaContext()
+{
+	ULlamaContextHandler::ReleaseLlamaContext(Weights, LlamaContext);
+	LlamaContext = nullptr;
+	ReleaseDraftContext();
+	Weights.Reset();
+}
+
+void ULlamaContext::SetSeed(int32 InSeed)
+{
+	Seed = static_cast<uint32>(InSeed);
+	if (LlamaContext != nullptr)
+	{
+		llama_set_rng_seed(LlamaContext, Seed);
+	}
+	SamplerState.SetSeed(Seed);
+}
+
+void ULlamaContext::ResetState()
+{
+	ResetConversation();
+	Prefix.Reset();
+	Suffix.Reset();
+	BatchSize = MaxBatchSize;
+	Cancellation.Reset();
+	DiscardSnapshot();
+}
+
+void ULlamaContext::ResetConversation()
+{
+	Embeds.Reset();
+	ShiftScratch.Reset();
+	SamplerState.Reset();
+	Utf8Decoder.Reset();
+	DraftTokens.Reset();
+	IOSizes.Reset();
+	Checkpoints.Reset();
+	bEndsWithAnswer = false;
+	bEndsWithPartialPrompt = false;
+}
+
+bool ULlamaContext::MakeRoom(int NTokens)
+{
+	if (LlamaContext == nullptr)
+	{
+		return false;
+	}
+
+	const int Limit = llama_n_ctx(LlamaContext) - 4;
+	const int NPast = Embeds.Num();
+
+	if (NPast + NTokens < Limit)
+	{
+		return true;
+	}
+
+	const int NKeep = Embeds.GetKeep();
+	const int NTail = NPast - NKeep;
+
+	if (NKeep + NTokens >= Limit)
+	{
+		return false;
+	}
+
+	// Discard at least what is needed, and at least half of the unpinned history so shifts stay rare
+	int NDiscard = FMath::Min(NTail, FMath::Max(NPast + NTokens - Limit + 1, NTail / 2));
+
+	// Prefer cutting on a block boundary so the model never sees half of a prompt or answer
+	int Boundary = 0;
+	for (const int Size : IOSizes)
+	{
+		Boundary += Size;
+		if (Boundary - NKeep >= NDiscard)
+		{
+			if (Boundary <= NPast)
+			{
+				NDiscard = Boundary - NKeep;
+			}
+			break;
+		}
+	}
+
+	// A prompt still being transcribed is never cut: the next transcript is compared to it token by token
+	if (bEndsWithPartialPrompt && IOSizes.Num() > 0)
+	{
+		NDiscard = FMath::Min(NDiscard, NPast - IOSizes.Last() - NKeep);
+	}
+
+	if (NDiscard <= 0)
+	{
+		return false;
+	}
+
+	UE_LOG(LogTemp, Warning, TEXT("[LLama Integration] Context window full: discarding %d tokens"), NDiscard);
+
+	// Remove the discarded range [NKeep, NKeep + NDiscard) from the block sizes
+	const int RangeEnd = NKeep + NDiscard;
+	int BlockStart = 0;
+	for (int i = 0; i < IOSizes.Num() && BlockStart < RangeEnd;)
+	{
+		const int BlockEnd = BlockStart + IOSizes[i];
+		const int Overlap = FMath::Max(0, FMath::Min(BlockEnd, RangeEnd) - FMath::Max(BlockStart, NKeep));
+		BlockStart = BlockEnd;
+
+		IOSizes[i] -= Overlap;
+		if (IOSizes[i] == 0)
+		{
+			IOSizes.RemoveAt(i);
+		}
+		else
+		{
+			i++;
+		}
+	}
+
+	Embeds.DiscardOldest(NDiscard);
+	ShiftCheckpoints(NKeep, NDiscard);
+
+	// The kept tail moved back: evaluate it again right after the pinned prefix
+	Embeds.CopyTail(NKeep, ShiftScratch);
+	const int BatchSize = GetBatchSize();
+
+	for (int32 i = 0; i < ShiftScratch.Num(); i += BatchSize)
+	{
+		const int NEval = FMath::Min(BatchSize, ShiftScratch.Num() - i);
+		SetLastEvalSize(NEval);
+		if (ShouldStop() || llama_eval(LlamaContext, ShiftScratch.GetData() + i, NEval, NKeep + i, SETTINGS->NThreadToUse) != 0)
+		{
+			// Only keep what the KV cache actually holds
+			Embeds.Truncate(NKeep + i);
+			SyncIOSizes();
+			TrimCheckpoints();
+			return false;
+		}
+	}
+
+	return Embeds.Num() + NTokens < Limit;
+}
+
+void ULlamaContext::SyncIOSizes()
+{
+	int Excess = -Embeds.Num();
+	for (const int Size : IOSizes)
+	{
+		Excess += Size;
+	}
+
+	while (Excess > 0 && IOSizes.Num() > 0)
+	{
+		const int Removed = FMath::Min(Excess, IOSizes.Last());
+		IOSizes.Last() -= Removed;
+		Excess -= Removed;
+		if (IOSizes.Last() == 0)
+		{
+			IOSizes.Pop();
+		}
+	}
+}
+
+void ULlamaContext::PushTurnCheckpoint()
+{
+	FLlamaTurnCheckpoint& Checkpoint = Checkpoints.AddDefaulted_GetRef();
+	Checkpoint.NPast = Embeds.Num();
+	Checkpoint.Sampler = SamplerState.MakeCheckpoint();
+}
+
+void ULlamaContext::ShiftCheckpoints(int NKeep, int NDiscard)
+{
+	const int RangeEnd = NKeep + NDiscard;
+	Checkpoints.RemoveAll([NKeep, RangeEnd](const FLlamaTurnCheckpoint& Checkpoint)
+	{
+		return Checkpoint.NPast > NKeep && Checkpoint.NPast < RangeEnd;
+	});
+
+	for (FLlamaTurnCheckpoint& Checkpoint : Checkpoints)
+	{
+		if (Checkpoint.NPast >= RangeEnd)
+		{
+			Checkpoint.NPast -= NDiscard;
+		}
+	}
+}
+
+void ULlamaContext::TrimCheckpoints()
+{
+	while (Checkpoints.Num() > 0 && Checkpoints.Last().NPast > Embeds.Num())
+	{
+		Checkpoints.Pop(false);
+	}
+}
+
+bool ULlamaContext::RollbackToTurn(int32 Turn)
+{
+	FRWScopeLock ContextLock(WriteLock, SLT_Write);
+	return RollbackToTurnLocked(Turn);
+}
+
+bool ULlamaContext::RollbackToTurnLocked(int32 Turn)
+{
+	if (!Checkpoints.IsValidIndex(Turn))
+	{
+		UE_LOG(LogTemp, Warning, TEXT("[LLama Integration] Impossible to roll back to turn %d: the context only has %d turns !"), Turn, Checkpoints.Num());
+		return false;
+	}
+
+	const FLlamaTurnCheckpoint Checkpoint = Checkpoints[Turn];
+	Checkpoints.SetNum(Turn, false);
+	bEndsWithAnswer = false;
+	bEndsWithPartialPrompt = false;
+
+	if (Checkpoint.NPast < Embeds.GetKeep())
+	{
+		// The turn started before the pinned prefix: start over, the next prompt gets the prefix back from the prefix cache
+		Embeds.Reset();
+		IOSizes.Reset();
+		SamplerState.Reset();
+	}
+	else
+	{
+		// The KV cache past n_past is simply overwritten by the next evaluation
+		Embeds.Truncate(Checkpoint.NPast);
+		SyncIOSizes();
+
+		if (!SamplerState.Restore(Checkpoint.Sampler))
+		{
+			// Too many tokens were sampled since the checkpoint: remember the end of the history again
+			const int NTokens = FMath::Min(Embeds.Num(), SamplerState.GetCapacity());
+			for (int i = Embeds.Num() - NTokens; i < Embeds.Num(); i++)
+			{
+				SamplerState.Add(Embeds[i]);
+			}
+		}
+	}
+
+	Utf8Decoder.Reset();
+	return true;
+}
+
+int ULlamaContext::TruncateLastBlock(int NKept)
+{
+	if (IOSizes.Num() == 0)
+	{
+		return 0;
+	}
+
+	const int NRemoved = FMath::Clamp(IOSizes.Last() - FMath::Max(0, NKept), 0, Embeds.Num() - Embeds.GetKeep());
+	if (NRemoved == 0)
+	{
+		return 0;
+	}
+
+	// The tokens of the last block are the last ones added to the sampler as well
+	Embeds.Truncate(Embeds.Num() - NRemoved);
+	SamplerState.RemoveLast(NRemoved);
+	IOSizes.Last() -= NRemoved;
+	TrimCheckpoints();
+	Utf8Decoder.Reset();
+	return NRemoved;
+}
+
+int ULlamaContext::TruncateAnswer(int NSpoken)
+{
+	if (!bEndsWithAnswer)
+	{
+		return 0;
+	}
+
+	const int NRemoved = TruncateLastBlock(NSpoken);
+	if (IOSizes.Num() > 0 && IOSizes.Last() == 0)
+	{
+		IOSizes.Pop(false);
+		bEndsWithAnswer = false;
+	}
+	return NRemoved;
+}
+
+bool ULlamaContext::CopyState(TArray64<uint8>& OutState) const
+{
+	OutState.Reset();
+	if (LlamaContext == nullptr)
+	{
+		return false;
+	}
+
+	// The maximum size covers the whole KV cache: a 7B model with 4096 tokens of f16 cache already needs 2 GB
+	const size_t MaxSize = llama_get_state_size(LlamaContext);
+	if (MaxSize == 0 || MaxSize > static_cast<size_t>(TNumericLimits<int64>::Max()))
+	{
+		UE_LOG(LogTemp, Warning, TEXT("[LLama Integration] Impossible to copy the state of a context: invalid state size !"));
+		return false;
+	}
+
+	OutState.SetNumUninitialized(static_cast<int64>(MaxSize));
+	const size_t Written = llama_copy_state_data(LlamaContext, OutState.GetData());
+	if (Written > MaxSize)
+	{
+		UE_LOG(LogTemp, Warning, TEXT("[LLama Integration] The state of a context overflowed its buffer !"));
+		OutState.Empty();
+		return false;
+	}
+
+	OutState.SetNum(static_cast<int64>(Written), true);
+	return true;
+}
+
+bool ULlamaContext::SaveConversation(const FString& SlotName)
+{
+	FRWScopeLock ContextLock(WriteLock, SLT_Write);
+	if (LlamaContext == nullptr && !ULlamaContextHandler::ResumeContext(this))
+	{
+		UE_LOG(LogTemp, Warning, TEXT("[LLama Integration] Impossible to save the conversation: valid context missing !"));
+		return false;
+	}
+
+	const FString SessionPath = GetConversationPath(SlotName, TEXT(".session"));
+	IFileManager::Get().MakeDirectory(*FPaths::GetPath(SessionPath), true);
+
+	TArray<llama_token> Tokens;
+	Embeds.CopyTail(0, Tokens);
+
+	if (!llama_save_session_file(LlamaContext, TCHAR_TO_UTF8(*SessionPath), Tokens.GetData(), Tokens.Num()))
+	{
+		UE_LOG(LogTemp, Warning, TEXT("[LLama Integration] Impossible to save the conversation in %s !"), *SessionPath);
+		return false;
+	}
+
+	int32 Version = ConversationVersion;
+	int32 NKeep = Embeds.GetKeep();
+	FString ModelPath = Model ? Model->GetModelPath() : FString();
+
+	FBufferArchive Archive;
+	Archive << Version;
+	Archive << ModelPath;
+	Archive << NKeep;
+	Archive << IOSizes;
+	Archive << Prefix;
+	Archive << Suffix;
+
+	int32 NCheckpoints = Checkpoints.Num();
+	Archive << NCheckpoints;
+	for (FLlamaTurnCheckpoint& Checkpoint : Checkpoints)
+	{
+		SerializeCheckpoint(Archive, Checkpoint);
+	}
+	Archive << bEndsWithAnswer;
+
+	return FFileHelper::SaveArrayToFile(Archive, *GetConversationPath(SlotName, TEXT(".conversation")));
+}
+
+bool ULlamaContext::LoadConversation(const FString& SlotName)
+{
+	FRWScopeLock ContextLock(WriteLock, SLT_Write);
+	if (LlamaContext == nullptr && !ULlamaContextHandler::ResumeContext(this))
+	{
+		UE_LOG(LogTemp, Warning, TEXT("[LLama Integration] Impossible to load the conversation: valid context missing !"));
+		return false;
+	}
+
+	TArray<uint8> Data;
+	if (!FFileHelper::LoadFileToArray(Data, *GetConversationPath(SlotName, TEXT(".conversation"))))
+	{
+		UE_LOG(LogTemp, Warning, TEXT("[LLama Integration] Impossible to load the conversation %s: no such save !"), *SlotName);
+		return false;
+	}
+
+	int32 Version = 0;
+	FString ModelPath;
+	int32 NKeep = 0;
+	TArray<int> SavedIOSizes;
+	FString SavedPrefix;
+	FString SavedSuffix;
+	TArray<FLlamaTurnCheckpoint> SavedCheckpoints;
+	bool bSavedEndsWithAnswer = false;
+
+	FMemoryReader Archive(Data);
+	Archive << Version;
+	if (Version < 1 || Version > ConversationVersion)
+	{
+		UE_LOG(LogTemp, Warning, TEXT("[LLama Integration] Impossible to load the conversation %s: unsupported version !"), *SlotName);
+		return false;
+	}
+	Archive << ModelPath;
+	Archive << NKeep;
+	Archive << SavedIOSizes;
+	Archive << SavedPrefix;
+	Archive << SavedSuffix;
+
+	// Version 1 saves have no turns to roll back to
+	if (Version >= 2)
+	{
+		int32 NCheckpoints = 0;
+		Archive << NCheckpoints;
+		for (int32 i = 0; i < NCheckpoints && !Archive.IsError(); i++)
+		{
+			SerializeCheckpoint(Archive, SavedCheckpoints.AddDefaulted_GetRef());
+		}
+		Archive << bSavedEndsWithAnswer;
+	}
+
+	if (Archive.IsError())
+	{
+		UE_LOG(LogTemp, Warning, TEXT("[LLama Integration] Impossible to load the conversation %s: the save is corrupted !"), *SlotName);
+		return false;
+	}
+
+	if (Model && !ModelPath.IsEmpty() && Model->GetModelPath() != ModelPath)
+	{
+		UE_LOG(LogTemp, Warning, TEXT("[LLama Integration] Impossible to load the conversation %s: it was saved with another model !"), *SlotName);
+		return false;
+	}
+
+	// llama restores the KV cache and the tokens it holds
+	TArray<llama_token> Tokens;
+	Tokens.SetNumUninitialized(llama_n_ctx(LlamaContext));
+	size_t NTokens = 0;
+
+	ResetState();
+	const FString SessionPath = GetConversationPath(SlotName, TEXT(".session"));
+	if (!llama_load_session_file(LlamaContext, TCHAR_TO_UTF8(*SessionPath), Tokens.GetData(), Tokens.Num(), &NTokens))
+	{
+		UE_LOG(LogTemp, Warning, TEXT("[LLama Integration] Impossible to load the conversation from %s !"), *SessionPath);
+		return false;
+	}
+	Tokens.SetNum(static_cast<int32>(NTokens));
+
+	Embeds.Append(Tokens);
+	Embeds.Pin(NKeep);
+
+	// The sampler state is rebuilt token by token, with a checkpoint taken where each saved turn starts
+	int NAppended = 0;
+	for (const FLlamaTurnCheckpoint& Saved : SavedCheckpoints)
+	{
+		if (Saved.NPast < NAppended || Saved.NPast > Tokens.Num())
+		{
+			continue;
+		}
+
+		SamplerState.Append(Tokens.GetData() + NAppended, Saved.NPast - NAppended);
+		NAppended = Saved.NPast;
+
+		FLlamaTurnCheckpoint& Checkpoint = Checkpoints.AddDefaulted_GetRef();
+		Checkpoint.NPast = Saved.NPast;
+		Checkpoint.Sampler = SamplerState.MakeCheckpoint();
+		for (int i = 0; i < 2; i++)
+		{
+			Checkpoint.Sampler.MirostatMu[i] = Saved.Sampler.MirostatMu[i];
+			Checkpoint.Sampler.bMirostatInitialized[i] = Saved.Sampler.bMirostatInitialized[i];
+		}
+	}
+	SamplerState.Append(Tokens.GetData() + NAppended, Tokens.Num() - NAppended);
+
+	IOSizes = MoveTemp(SavedIOSizes);
+	SyncIOSizes();
+	bEndsWithAnswer = bSavedEndsWithAnswer && IOSizes.Num() > 0;
+	Prefix = SavedPrefix;
+	Suffix = SavedSuffix;
+	return true;
+}
+
+llama_context* ULlamaContext::Suspend()
+{
+	if (LlamaContext == nullptr || bSuspended)
+	{
+		return nullptr;
+	}
+
+	// Only the evaluated part of the KV cache is copied, then compressed.
+	// This is the slow part, done before taking PoolLock so that other contexts can be created or resumed meanwhile.
+	TArray64<uint8> State;
+	if (!CopyState(State))
+	{
+		return nullptr;
+	}
+
+	// FCompression works on int32 sizes: a larger state is kept as is, like an incompressible one
+	TArray64<uint8> Compressed;
+	int64 RawSize = -1;
+	if (State.Num() <= MAX_int32)
+	{
+		int32 CompressedSize = FCompression::CompressMemoryBound(NAME_Oodle, static_cast<int32>(State.Num()));
+		if (CompressedSize > 0)
+		{
+			Compressed.SetNumUninitialized(CompressedSize);
+			if (FCompression::CompressMemory(NAME_Oodle, Compressed.GetData(), CompressedSize, State.GetData(), static_cast<int32>(State.Num())))
+			{
+				Compressed.SetNum(CompressedSize, true);
+				RawSize = State.Num();
+			}
+		}
+	}
+
+	if (RawSize < 0)
+	{
+		Compressed = MoveTemp(State);
+	}
+
+	// The draft context is not pooled: it is freed, and catches up with the history after the context resumes
+	ReleaseDraftContext();
+
+	// The handler reads the snapshots and counts the llama contexts in use under PoolLock
+	FScopeLock ScopeLock(&ULlamaContextHandler::GetPoolLock());
+	Snapshot = MakeShared<const TArray64<uint8>, ESPMode::ThreadSafe>(MoveTemp(Compressed));
+	SnapshotRawSize = RawSize;
+
+	llama_context* FreeContext = LlamaContext;
+	LlamaContext = nullptr;
+	bSuspended = true;
+	return FreeContext;
+}
+
+bool ULlamaContext::Resume(llama_context* FreeContext)
+{
+	FSnapshotPtr Data;
+	FString File;
+	int64 RawSize = -1;
+	{
+		FScopeLock ScopeLock(&ULlamaContextHandler::GetPoolLock());
+		LlamaContext = FreeContext;
+		bSuspended = false;
+
+		Data = MoveTemp(Snapshot);
+		Snapshot.Reset();
+		File = MoveTemp(SnapshotFile);
+		SnapshotFile.Reset();
+		RawSize = SnapshotRawSize;
+	}
+
+	// Reading, uncompressing and loading the KV cache happen outside PoolLock
+	if (!File.IsEmpty())
+	{
+		TArray64<uint8> Loaded;
+		if (FFileHelper::LoadFileToArray(Loaded, *File))
+		{
+			Data = MakeShared<const TArray64<uint8>, ESPMode::ThreadSafe>(MoveTemp(Loaded));
+		}
+		IFileManager::Get().Delete(*File);
+	}
+
+	TArray64<uint8> Uncompressed;
+	const TArray64<uint8>* State = Data.Get();
+	bool bRestored = Data.IsValid() && Data->Num() > 0;
+	if (bRestored && RawSize >= 0)
+	{
+		// Only states that fit in int32 are compressed
+		bRestored = RawSize <= MAX_int32 && Data->Num() <= MAX_int32;
+		if (bRestored)
+		{
+			Uncompressed.SetNumUninitialized(RawSize);
+			bRestored = FCompression::UncompressMemory(NAME_Oodle, Uncompressed.GetData(), static_cast<int32>(Uncompressed.Num()), Data->GetData(), static_cast<int32>(Data->Num()));
+			State = &Uncompressed;
+		}
+	}
+
+	if (!bRestored)
+	{
+		UE_LOG(LogTemp, Warning, TEXT("[LLama Integration] Impossible to restore a suspended context, its conversation is lost !"));
+		ResetConversation();
+		return false;
+	}
+
+	llama_set_state_data(LlamaContext, const_cast<uint8*>(State->GetData()));
+	return true;
+}
+
+bool ULlamaContext::SetSnapshotFile(const FSnapshotPtr& Spilled, const FString& File)
+{
+	if (!Spilled.IsValid() || Snapshot != Spilled)
+	{
+		return false;
+	}
+
+	Snapshot.Reset();
+	SnapshotFile = File;
+	return true;
+}
+
+void ULlamaContext::DiscardSnapshot()
+{
+	FString File;
+	{
+		FScopeLock ScopeLock(&ULlamaContextHandler::GetPoolLock());
+		Snapshot.Reset();
+		File = MoveTemp(SnapshotFile);
+		SnapshotFile.Reset();
+	}
+
+	if (!File.IsEmpty())
+	{
+		IFileManager::Get().Delete(*File);
+	}
+}
@@ -2,55 +2,471 @@
 
 #include "LlamaContextHandler.h"
 
+#include "HAL/FileManager.h"
+#include "LlamaModelRegistry.h"
+#include "LlamaRunner.h"
+#include "LlamaScheduler.h"
 #include "LlamaSettings.h"
+#include "Misc/FileHelper.h"
+#include "Misc/Paths.h"
 
 TArray<ULlamaContext*> ULlamaContextHandler::Contexts = TArray<ULlamaContext*>();
+TArray<ULlamaContextHandler::FPooledContext> ULlamaContextHandler::PooledContexts;
+TMap<const FLlamaModelWeights*, int32> ULlamaContextHandler::CheckedOutContexts;
+FCriticalSection ULlamaContextHandler::PoolLock;
 
-ULlamaContext* ULlamaContextHandler::NewContextFromModel(ULlamaModel* Model)
+static llama_context_params GetContextParams(const FLlamaModelWeightsPtr& Weights = nullptr)
 {
 	auto LlamaDefaultParams = llama_context_default_params();
 	LlamaDefaultParams.n_ctx  = abs(SETTINGS->ContextSize);
+	LlamaDefaultParams.n_batch = FMath::Max(1, SETTINGS->BatchSize);
+	// Every context of a model shares its parameters, so pooled contexts can be reused by any of them
+	LlamaDefaultParams.logits_all = Weights.IsValid() && Weights->ComputesAllLogits();
+	return LlamaDefaultParams;
+}
+
+ULlamaContext* ULlamaContextHandler::NewContextFromModel(ULlamaModel* Model)
+{
+	// An evicted model is loaded back in the background, never here on the game thread
+	const FLlamaModelWeightsPtr Weights = FLlamaModelRegistry::Acquire(Model);
+
+	if (!Weights.IsValid())
+	{
+		if (Model && !Model->GetModelPath().IsEmpty())
+		{
+			UE_LOG(LogTemp, Warning, TEXT("[LLama Integration] Impossible to create a new context now: the model %s is being loaded back, try again once it is loaded !"), *Model->GetModelId());
+		}
+		else
+		{
+			UE_LOG(LogTemp, Warning, TEXT("[LLama Integration] Error while trying to create a new context: missing model !"));
+		}
+		return nullptr;
+	}
+
+	llama_context *loadedCtx = TakeLlamaContext(Weights, nullptr);
+	if (loadedCtx == nullptr)
+	{
+		return nullptr;
+	}
+
+	const int BatchSize = GetContextParams().n_batch;
+
+	ULlamaContext* NewContext = NewObject<ULlamaContext>();
+	NewContext->SetLlamaContext(loadedCtx);
+	NewContext->SetModel(Model);
+	NewContext->GetEmbeds().SetCapacity(llama_n_ctx(loadedCtx));
+	NewContext->GetSamplerState().SetCapacity(llama_n_ctx(loadedCtx));
+	NewContext->SetMaxBatchSize(BatchSize);
+	NewContext->SetBatchSize(BatchSize);
+	NewContext->SetSeed(static_cast<int32>(FPlatformTime::Cycles64() ^ reinterpret_cast<UPTRINT>(NewContext)));
+	NewContext->Touch();
+
+	{
+		FScopeLock ScopeLock(&PoolLock);
+		Contexts.Add(NewContext);
+	}
+
+	UE_LOG(LogTemp, Warning, TEXT("[LLama Integration] A new context was made with size %d !"), llama_n_ctx(loadedCtx));
+	return NewContext;
+}
 
-	if (Model != nullptr && Model->GetInstance() != nullptr)
+llama_context* ULlamaContextHandler::TakeLlamaContext(const FLlamaModelWeightsPtr& Weights, const ULlamaContext* Requester)
+{
+	const int PoolSize = SETTINGS->ContextPoolSize;
+	ULlamaContext* Victim = nullptr;
 	{
-		llama_context *loadedCtx = llama_new_context_with_model(ULlamaModel::GetInstance()->GetLlamaModel(), LlamaDefaultParams);
+		FScopeLock ScopeLock(&PoolLock);
+
+		if (PoolSize > 0)
+		{
+			const int32 PooledIndex = PooledContexts.IndexOfByPredicate([&Weights](const FPooledContext& Pooled)
+			{
+				return Pooled.Weights == Weights;
+			});
+
+			if (PooledIndex != INDEX_NONE)
+			{
+				llama_context* LlamaContext = PooledContexts[PooledIndex].LlamaContext;
+				PooledContexts.RemoveAtSwap(PooledIndex);
+				CheckedOutContexts.FindOrAdd(Weights.Get())++;
+				return LlamaContext;
+			}
+
+			if (CountLlamaContexts(Weights) >= PoolSize)
+			{
+				// The pool is exhausted: the least recently used context that is not generating gives its memory away
+				TArray<ULlamaContext*> Candidates = Contexts.FilterByPredicate([&Weights, Requester](const ULlamaContext* Context)
+				{
+					return Context != Requester && Context->GetLlamaContext() != nullptr && Context->GetWeights() == Weights;
+				});
+				Candidates.Sort([](const ULlamaContext& A, const ULlamaContext& B)
+				{
+					return A.GetLastUsedTime() < B.GetLastUsedTime();
+				});
+
+				// Locked while still listed: a context is unlisted before being freed, so it cannot go away before it is suspended
+				for (ULlamaContext* Candidate : Candidates)
+				{
+					if (Candidate->GetLock().TryWriteLock())
+					{
+						Victim = Candidate;
+						break;
+					}
+				}
 
-		if (loadedCtx == nullptr)
+				if (Victim == nullptr)
+				{
+					UE_LOG(LogTemp, Warning, TEXT("[LLama Integration] Error while trying to create a new context: the context pool is exhausted (%d contexts) !"), PoolSize);
+					return nullptr;
+				}
+			}
+		}
+
+		if (Victim == nullptr)
+		{
+			// The slot is reserved before the allocation, so that concurrent requests never grow the pool past its size
+			CheckedOutContexts.FindOrAdd(Weights.Get())++;
+		}
+	}
+
+	if (Victim == nullptr)
+	{
+		// Allocating the KV cache and the buffers is slow: it happens outside PoolLock
+		llama_context* LlamaContext = llama_new_context_with_model(Weights->GetLlamaModel(), GetContextParams(Weights));
+		if (LlamaContext == nullptr)
 		{
 			UE_LOG(LogTemp, Warning, TEXT("[LLama Integration] Error while trying to create a new context !"));
-			return nullptr;
-		} 
-		
-		ULlamaContext* NewContext = NewObject<ULlamaContext>();
-		NewContext->SetLlamaContext(loadedCtx);
-		Contexts.Add(NewContext);
+			FScopeLock ScopeLock(&PoolLock);
+			CheckIn(Weights);
+		}
+		return LlamaContext;
+	}
+
+	// Copying and compressing the KV cache of the victim is slow: it happens outside PoolLock.
+	// Its llama context stays checked out, it only changes hands.
+	llama_context* LlamaContext = Victim->Suspend();
+	Victim->GetLock().WriteUnlock();
+
+	if (LlamaContext == nullptr)
+	{
+		UE_LOG(LogTemp, Warning, TEXT("[LLama Integration] Error while trying to create a new context: an idle context could not be suspended !"));
+		return nullptr;
+	}
+
+	SpillSnapshots();
+	return LlamaContext;
+}
+
+void ULlamaContextHandler::ReturnLlamaContext(const FLlamaModelWeightsPtr& Weights, llama_context* LlamaContext)
+{
+	if (LlamaContext == nullptr)
+	{
+		return;
+	}
 
-		UE_LOG(LogTemp, Warning, TEXT("[LLama Integration] A new context was made with size %d !"), llama_n_ctx(loadedCtx));
-		return NewContext;
-		
+	{
+		FScopeLock ScopeLock(&PoolLock);
+		CheckIn(Weights);
+		if (SETTINGS->ContextPoolSize > 0 && Weights.IsValid())
+		{
+			// The next request on it starts again at n_past = 0: the KV cache is overwritten, not reallocated
+			PooledContexts.Add({ Weights, LlamaContext });
+			return;
+		}
 	}
 
-	UE_LOG(LogTemp, Warning, TEXT("[LLama Integration] Error while trying to create a new context: missing model !"));
-	return nullptr;
+	llama_free(LlamaContext);
+}
+
+void ULlamaContextHandler::ReleaseLlamaContext(const FLlamaModelWeightsPtr& Weights, llama_context* LlamaContext)
+{
+	if (LlamaContext == nullptr)
+	{
+		return;
+	}
+
+	{
+		FScopeLock ScopeLock(&PoolLock);
+		CheckIn(Weights);
+	}
+	llama_free(LlamaContext);
+}
+
+void ULlamaContextHandler::CheckIn(const FLlamaModelWeightsPtr& Weights)
+{
+	int32* CheckedOut = CheckedOutContexts.Find(Weights.Get());
+	if (CheckedOut != nullptr && --(*CheckedOut) <= 0)
+	{
+		CheckedOutContexts.Remove(Weights.Get());
+	}
 }
 
 void ULlamaContextHandler::FreeContext(ULlamaContext* Context)
 {
-	if (Context != nullptr && Context->GetLlamaContext() != nullptr && !Context->isUnloaded)
+	if (Context == nullptr || Context->isUnloaded)
+	{
+		return;
+	}
+
+	// Without a pool, or if the model of the context was replaced meanwhile, the memory is freed
+	if (SETTINGS->ContextPoolSize <= 0 || Context->GetModel() == nullptr || Context->GetModel()->GetWeights() != Context->GetWeights())
+	{
+		DestroyContext(Context);
+		return;
+	}
+
+	UnlistContext(Context);
+
+	// Stops the running generation, then hands the llama context to the pool
+	Context->stop = true;
+	Context->isUnloaded = true;
+	FRWScopeLock ContextLock = FRWScopeLock(Context->GetLock(), SLT_Write);
+	Context->ResetState();
+
+	const FLlamaModelWeightsPtr Weights = Context->GetWeights();
+	ReturnLlamaContext(Weights, Context->DetachLlamaContext());
+	FLlamaModelRegistry::Touch(Context->GetModel());
+}
+
+void ULlamaContextHandler::DestroyContext(ULlamaContext* Context)
+{
+	if (Context == nullptr)
+	{
+		return;
+	}
+
+	UnlistContext(Context);
+
+	if (!Context->isUnloaded)
 	{
 		Context->stop = true;
 		Context->isUnloaded = true;
 		FRWScopeLock ContextLock = FRWScopeLock(Context->GetLock(), SLT_Write);
-		llama_free(Context->GetLlamaContext());
+		Context->ResetState();
+		Context->ReleaseLlamaContext();
+		FLlamaModelRegistry::Touch(Context->GetModel());
 		UE_LOG(LogTemp, Warning, TEXT("[LLama Integration] A Context was unloaded !"));
 	}
 }
 
+void ULlamaContextHandler::FreePooledContexts(const FLlamaModelWeightsPtr& Weights)
+{
+	FScopeLock ScopeLock(&PoolLock);
+	PooledContexts.RemoveAll([&Weights](const FPooledContext& Pooled)
+	{
+		if (Pooled.Weights != Weights)
+		{
+			return false;
+		}
+		llama_free(Pooled.LlamaContext);
+		return true;
+	});
+}
+
+int ULlamaContextHandler::CountPooledContexts(const FLlamaModelWeightsPtr& Weights)
+{
+	FScopeLock ScopeLock(&PoolLock);
+	int Count = 0;
+	for (const FPooledContext& Pooled : PooledContexts)
+	{
+		if (Pooled.Weights == Weights)
+		{
+			Count++;
+		}
+	}
+	return Count;
+}
+
+void ULlamaContextHandler::UnlistContext(ULlamaContext* Context)
+{
+	FScopeLock ScopeLock(&PoolLock);
+	Contexts.Remove(Context);
+}
+
+bool ULlamaContextHandler::SuspendContext(ULlamaContext* Context)
+{
+	if (Context == nullptr || Context->isUnloaded)
+	{
+		UE_LOG(LogTemp, Warning, TEXT("[LLama Integration] Impossible to suspend a context: valid context missing !"));
+		return false;
+	}
+
+	FRWScopeLock ContextLock = FRWScopeLock(Context->GetLock(), SLT_Write);
+	llama_context* LlamaContext = Context->Suspend();
+	if (LlamaContext == nullptr)
+	{
+		return false;
+	}
+
+	ReturnLlamaContext(Context->GetWeights(), LlamaContext);
+	SpillSnapshots();
+	return true;
+}
+
+void ULlamaContextHandler::PrefetchContext(ULlamaContext* Context)
+{
+	if (Context == nullptr || !Context->IsSuspended())
+	{
+		return;
+	}
+
+	FLlamaScheduler::Submit(Context, static_cast<int32>(ELlamaPriority::Background), [Context]()
+	{
+		FRWScopeLock ContextLock = FRWScopeLock(Context->GetLock(), SLT_Write);
+		if (!Context->isUnloaded)
+		{
+			ResumeContext(Context);
+		}
+	});
+}
+
+bool ULlamaContextHandler::ResumeContext(ULlamaContext* Context)
+{
+	if (!Context->IsSuspended())
+	{
+		return Context->GetLlamaContext() != nullptr;
+	}
+
+	llama_context* LlamaContext = TakeLlamaContext(Context->GetWeights(), Context);
+	if (LlamaContext == nullptr)
+	{
+		return false;
+	}
+
+	Context->Resume(LlamaContext);
+	return true;
+}
+
+int ULlamaContextHandler::FillContextPool(ULlamaModel* Model)
+{
+	const int PoolSize = SETTINGS->ContextPoolSize;
+	const FLlamaModelWeightsPtr Weights = FLlamaModelRegistry::Acquire(Model);
+	if (!Weights.IsValid() || PoolSize <= 0)
+	{
+		return 0;
+	}
+
+	// The missing slots are reserved, then the contexts are allocated outside PoolLock
+	int NMissing = 0;
+	{
+		FScopeLock ScopeLock(&PoolLock);
+		NMissing = FMath::Max(0, PoolSize - CountLlamaContexts(Weights));
+		if (NMissing > 0)
+		{
+			CheckedOutContexts.FindOrAdd(Weights.Get()) += NMissing;
+		}
+	}
+
+	for (int i = 0; i < NMissing; i++)
+	{
+		llama_context* LlamaContext = llama_new_context_with_model(Weights->GetLlamaModel(), GetContextParams(Weights));
+
+		FScopeLock ScopeLock(&PoolLock);
+		CheckIn(Weights);
+		if (LlamaContext == nullptr)
+		{
+			UE_LOG(LogTemp, Warning, TEXT("[LLama Integration] Error while trying to create a new context !"));
+			// The slots left are given back
+			for (int j = i + 1; j < NMissing; j++)
+			{
+				CheckIn(Weights);
+			}
+			break;
+		}
+		PooledContexts.Add({ Weights, LlamaContext });
+	}
+
+	FScopeLock ScopeLock(&PoolLock);
+	return PooledContexts.FilterByPredicate([&Weights](const FPooledContext& Pooled)
+	{
+		return Pooled.Weights == Weights;
+	}).Num();
+}
+
+int ULlamaContextHandler::CountLlamaContexts(const FLlamaModelWeightsPtr& Weights)
+{
+	// Checked out ones include those handed out but not attached to their context yet
+	int Count = CheckedOutContexts.FindRef(Weights.Get());
+	for (const FPooledContext& Pooled : PooledContexts)
+	{
+		if (Pooled.Weights == Weights)
+		{
+			Count++;
+		}
+	}
+	return Count;
+}
+
+void ULlamaContextHandler::SpillSnapshots()
+{
+	const int64 Budget = static_cast<int64>(SETTINGS->SuspendedContextsRamMB) * 1024 * 1024;
+
+	struct FSpill
+	{
+		ULlamaContext* Context = nullptr;
+		ULlamaContext::FSnapshotPtr Snapshot;
+	};
+	TArray<FSpill> Spills;
+	{
+		FScopeLock ScopeLock(&PoolLock);
+
+		int64 InRam = 0;
+		TArray<ULlamaContext*> InRamContexts;
+		for (ULlamaContext* Context : Contexts)
+		{
+			if (Context->GetSnapshotRamSize() > 0)
+			{
+				InRam += Context->GetSnapshotRamSize();
+				InRamContexts.Add(Context);
+			}
+		}
+
+		InRamContexts.Sort([](const ULlamaContext& A, const ULlamaContext& B)
+		{
+			return A.GetLastUsedTime() < B.GetLastUsedTime();
+		});
+
+		for (ULlamaContext* Context : InRamContexts)
+		{
+			if (InRam <= Budget)
+			{
+				break;
+			}
+			InRam -= Context->GetSnapshotRamSize();
+			Spills.Add({ Context, Context->GetSnapshot() });
+		}
+	}
+
+	// The files are written outside PoolLock. The shared snapshot stays valid meanwhile,
+	// and only moves to its file if the context was not resumed, reset or freed since.
+	for (const FSpill& Spill : Spills)
+	{
+		const FString File = FPaths::Combine(FPaths::ProjectSavedDir(), TEXT("LlamaCache"), FGuid::NewGuid().ToString() + TEXT(".kv"));
+		if (!FFileHelper::SaveArrayToFile(*Spill.Snapshot, *File))
+		{
+			UE_LOG(LogTemp, Warning, TEXT("[LLama Integration] Impossible to move a suspended context to disk !"));
+			IFileManager::Get().Delete(*File, false, false, true);
+			return;
+		}
+
+		bool bSpilled;
+		{
+			FScopeLock ScopeLock(&PoolLock);
+			bSpilled = Contexts.Contains(Spill.Context) && Spill.Context->SetSnapshotFile(Spill.Snapshot, File);
+		}
+
+		if (!bSpilled)
+		{
+			IFileManager::Get().Delete(*File, false, false, true);
+		}
+	}
+}
+
 void ULlamaContextHandler::SetPrefix(ULlamaContext* Context, FString PromptPrefix)
 {
 	if (Context)
 	{
-		Context->GetPrefix() = PromptPrefix;
+		Context->SetPrefix(PromptPrefix);
 	} else
 	{
 		UE_LOG(LogTemp, Warning, TEXT("[LLama Integration] Impossible to set a prefix: valid context missing !"));
@@ -62,11 +478,20 @@ void ULlamaContextHandler::SetSuffix(ULlamaContext* Context, FString PromptSuffi
 {
 	if (Context)
 	{
-		Context->GetSuffix() = PromptSuffix;
+		Context->SetSuffix(PromptSuffix);
 	} else
 	{
 		UE_LOG(LogTemp, Warning, TEXT("[LLama Integration] Impossible to set a suffix: valid context missing !"));
 	}
 }
 
-
+void ULlamaContextHandler::SetBatchSize(ULlamaContext* Context, int BatchSize)
+{
+	if (Context)
+	{
+		Context->SetBatchSize(BatchSize);
+	} else
+	{
+		UE_LOG(LogTemp, Warning, TEXT("[LLama Integration] Impossible to set a batch size: valid context missing !"));
+	}
+}
@@ -0,0 +1,107 @@
+﻿// Copyright 2023 Isara Technologies SAS. All Rights Reserved.
+
+#include "LlamaDetokenizer.h"
+
+static constexpr uint32 ReplacementCharacter = 0xFFFD;
+
+void FLlamaTokenPieces::Build(const llama_model* Model)
+{
+	Reset();
+
+	if (Model == nullptr)
+	{
+		return;
+	}
+
+	const int NVocab = llama_model_n_vocab(Model);
+	Offsets.Reserve(NVocab + 1);
+	Bytes.Reserve(NVocab * 4);
+
+	TArray<char> Piece;
+	Piece.SetNumUninitialized(64);
+
+	for (llama_token Token = 0; Token < NVocab; Token++)
+	{
+		int Len = llama_token_to_piece_with_model(Model, Token, Piece.GetData(), Piece.Num());
+		if (Len < 0)
+		{
+			Piece.SetNumUninitialized(-Len);
+			Len = llama_token_to_piece_with_model(Model, Token, Piece.GetData(), Piece.Num());
+		}
+
+		Offsets.Add(Bytes.Num());
+		Bytes.Append(Piece.GetData(), FMath::Max(0, Len));
+	}
+	Offsets.Add(Bytes.Num());
+}
+
+void FLlamaUtf8Decoder::AppendCodepoint(uint32 Codepoint, FString& Out)
+{
+	if (sizeof(TCHAR) == 2 && Codepoint > 0xFFFF)
+	{
+		Codepoint -= 0x10000;
+		Out.AppendChar(static_cast<TCHAR>(0xD800 + (Codepoint >> 10)));
+		Out.AppendChar(static_cast<TCHAR>(0xDC00 + (Codepoint & 0x3FF)));
+	}
+	else
+	{
+		Out.AppendChar(static_cast<TCHAR>(Codepoint));
+	}
+}
+
+void FLlamaUtf8Decoder::Decode(const ANSICHAR* Data, int Len, FString& Out)
+{
+	for (int i = 0; i < Len; i++)
+	{
+		const uint8 Byte = static_cast<uint8>(Data[i]);
+
+		if (NPending > 0)
+		{
+			if ((Byte & 0xC0) == 0x80)
+			{
+				Pending[NPending++] = Byte;
+				if (NPending < NExpected)
+				{
+					continue;
+				}
+
+				uint32 Codepoint = Pending[0] & (0xFF >> (NExpected + 1));
+				for (int j = 1; j < NExpected; j++)
+				{
+					Codepoint = (Codepoint << 6) | (Pending[j] & 0x3F);
+				}
+				AppendCodepoint(Codepoint, Out);
+				Reset();
+				continue;
+			}
+
+			// The sequence was cut: replace it and handle this byte as the start of a new one
+			AppendCodepoint(ReplacementCharacter, Out);
+			Reset();
+		}
+
+		if (Byte < 0x80)
+		{
+			Out.AppendChar(static_cast<TCHAR>(Byte));
+		}
+		else if ((Byte & 0xE0) == 0xC0 || (Byte & 0xF0) == 0xE0 || (Byte & 0xF8) == 0xF0)
+		{
+			NExpected = (Byte & 0xE0) == 0xC0 ? 2 : (Byte & 0xF0) == 0xE0 ? 3 : 4;
+			Pending[0] = Byte;
+			NPending = 1;
+		}
+		else
+		{
+			AppendCodepoint(ReplacementCharacter, Out);
+		}
+	}
+}
+
+void FLlamaUtf8Decoder::Flush(FString& Out)
+{
+	if (NPending > 0)
+	{
+		AppendCodepoint(ReplacementCharacter, Out);
+	}
+	Reset();
+}
@@ -2,72 +2,327 @@
 
 #include "LlamaModel.h"
 
+#include "Async/Async.h"
+#include "HAL/PlatformFileManager.h"
+#include "HAL/RunnableThread.h"
 #include "LlamaContextHandler.h"
+#include "LlamaModelRegistry.h"
 #include "LlamaSettings.h"
+#include "LlamaStreamQueue.h"
+
+#if PLATFORM_LINUX || PLATFORM_ANDROID
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
 ULlamaModel *ULlamaModel::Instance = nullptr;
-FRWLock ULlamaModel::WriteLock;
 
-ULlamaModel::~ULlamaModel()
+// Whether two models map the same ids to the same tokens, so that tokens proposed by one can be checked by the other
+static bool HaveSameVocabulary(const FLlamaModelWeights& A, const FLlamaModelWeights& B)
 {
-	if (!isUnloaded)
-		FreeModel();
+	const FLlamaTokenPieces& PiecesA = A.GetTokenPieces();
+	const FLlamaTokenPieces& PiecesB = B.GetTokenPieces();
+	if (llama_model_n_vocab(A.GetLlamaModel()) != llama_model_n_vocab(B.GetLlamaModel()) || PiecesA.Num() != PiecesB.Num())
+	{
+		return false;
+	}
+
+	for (llama_token Token = 0; Token < PiecesA.Num(); Token++)
+	{
+		int LenA = 0;
+		int LenB = 0;
+		const ANSICHAR* PieceA = PiecesA.GetPiece(Token, LenA);
+		const ANSICHAR* PieceB = PiecesB.GetPiece(Token, LenB);
+		if (LenA != LenB || FMemory::Memcmp(PieceA, PieceB, LenA) != 0)
+		{
+			return false;
+		}
+	}
+
+	// Special tokens have no piece, and this llama only gives them through a context: a tiny one is enough
+	auto LlamaDefaultParams = llama_context_default_params();
+	LlamaDefaultParams.n_ctx = 8;
+	LlamaDefaultParams.n_batch = 8;
+
+	llama_context* ContextA = llama_new_context_with_model(A.GetLlamaModel(), LlamaDefaultParams);
+	llama_context* ContextB = llama_new_context_with_model(B.GetLlamaModel(), LlamaDefaultParams);
+	const bool bSameSpecialTokens = ContextA && ContextB
+		&& llama_token_bos(ContextA) == llama_token_bos(ContextB)
+		&& llama_token_eos(ContextA) == llama_token_eos(ContextB)
+		&& llama_token_nl(ContextA) == llama_token_nl(ContextB);
+
+	if (ContextA)
+	{
+		llama_free(ContextA);
+	}
+	if (ContextB)
+	{
+		llama_free(ContextB);
+	}
+	return bSameSpecialTokens;
+}
+
+FLlamaModelWeights::FLlamaModelWeights(llama_model* InModel) : LlamaModel(InModel)
+{
+	TokenPieces.Build(LlamaModel);
+}
+
+FLlamaModelWeights::~FLlamaModelWeights()
+{
+	llama_free_model(LlamaModel);
+	UE_LOG(LogTemp, Warning, TEXT("[LLama Integration] The Model was unloaded !"));
 }
 
-ULlamaModel *ULlamaModel::LoadModel(const FString& ModelPath)
+FLlamaModelWeightsPtr FLlamaModelWeights::Load(const FString& RequestedPath, const FLlamaModelLoadOptions& Options, TFunction<void(float)> OnProgress)
 {
-	isUnloaded = false;
-	const char *Path = TCHAR_TO_UTF8(*ModelPath);
+	const FString ModelPath = ULlamaModel::ResolveModelPath(RequestedPath);
+
 	auto LlamaDefaultParams = llama_context_default_params();
 	LlamaDefaultParams.n_ctx = abs(SETTINGS->ContextSize);
+	LlamaDefaultParams.use_mmap = Options.bUseMmap;
+	LlamaDefaultParams.use_mlock = Options.bUseMlock;
+
+	if (OnProgress)
+	{
+		LlamaDefaultParams.progress_callback = [](float Progress, void* UserData)
+		{
+			(*static_cast<TFunction<void(float)>*>(UserData))(Progress);
+		};
+		LlamaDefaultParams.progress_callback_user_data = &OnProgress;
+	}
+
+	llama_model *LoadedModel = llama_load_model_from_file(TCHAR_TO_UTF8(*ModelPath), LlamaDefaultParams);
+	if (LoadedModel == nullptr)
+	{
+		UE_LOG(LogTemp, Warning, TEXT("[LLama Integration] Impossible to load a new model !"));
+		return nullptr;
+	}
 
-	llama_model *LoadedModel = llama_load_model_from_file(Path, LlamaDefaultParams);
+	UE_LOG(LogTemp, Warning, TEXT("[LLama Integration] The Model was loaded !"));
+	FLlamaModelWeightsPtr Weights = MakeShared<FLlamaModelWeights, ESPMode::ThreadSafe>(LoadedModel);
+	Weights->bPromptLookup = Options.bPromptLookup;
 
-	ULlamaModel *LlamaModel = NewObject<ULlamaModel>();
+	if (!Options.DraftModelPath.IsEmpty())
+	{
+		FLlamaModelLoadOptions DraftOptions = Options;
+		DraftOptions.DraftModelPath.Reset();
+		DraftOptions.bPromptLookup = false;
+		FLlamaModelWeightsPtr DraftWeights = Load(Options.DraftModelPath, DraftOptions);
 
-	if (LoadedModel)
+		// Proposed tokens are compared with the model's own: both must use the same vocabulary
+		if (DraftWeights.IsValid() && !HaveSameVocabulary(*Weights, *DraftWeights))
+		{
+			UE_LOG(LogTemp, Warning, TEXT("[LLama Integration] The draft model %s does not have the vocabulary of the model: it is not used !"), *Options.DraftModelPath);
+			DraftWeights.Reset();
+		}
+		Weights->DraftWeights = MoveTemp(DraftWeights);
+	}
+
+	if (Options.bWarmup)
 	{
-		UE_LOG(LogTemp, Warning, TEXT("[LLama Integration] The Model was loaded !"));
+		StartWarmup(Weights, ModelPath, Options.bUseMmap && llama_mmap_supported());
 	}
-		
-	else
+	return Weights;
+}
+
+void FLlamaModelWeights::StartWarmup(const FLlamaModelWeightsPtr& Weights, const FString& ModelPath, bool bMapped)
+{
+	// A weak reference: a model evicted or replaced during its warmup is freed anyway
+	TWeakPtr<FLlamaModelWeights, ESPMode::ThreadSafe> WeakWeights = Weights;
+
+	Async(EAsyncExecution::Thread, [WeakWeights, ModelPath, bMapped]()
 	{
-		UE_LOG(LogTemp, Warning, TEXT("[LLama Integration] Impossible to load a new model !"));
-		isUnloaded = true;
+		if (FRunnableThread* Thread = FRunnableThread::GetRunnableThread())
+		{
+			Thread->SetThreadPriority(TPri_Lowest);
+		}
+
+		const double StartTime = FPlatformTime::Seconds();
+
+		// Reading the file fills the page cache the weights are mapped from: the first evaluation only takes soft faults
+		if (bMapped)
+		{
+#if PLATFORM_LINUX || PLATFORM_ANDROID
+			const int File = open(TCHAR_TO_UTF8(*ModelPath), O_RDONLY);
+			if (File >= 0)
+			{
+				posix_fadvise(File, 0, 0, POSIX_FADV_WILLNEED);
+				close(File);
+			}
+#endif
+
+			TUniquePtr<IFileHandle> Handle(FPlatformFileManager::Get().GetPlatformFile().OpenRead(*ModelPath));
+			if (Handle.IsValid())
+			{
+				TArray<uint8> Chunk;
+				Chunk.SetNumUninitialized(4 * 1024 * 1024);
+
+				int64 Remaining = Handle->Size();
+				while (Remaining > 0 && WeakWeights.IsValid())
+				{
+					const int64 Size = FMath::Min<int64>(Remaining, Chunk.Num());
+					if (!Handle->Read(Chunk.GetData(), Size))
+					{
+						break;
+					}
+					Remaining -= Size;
+				}
+			}
+		}
+
+		// One token on a throwaway context touches every layer and sets up the backend buffers
+		const FLlamaModelWeightsPtr Weights = WeakWeights.Pin();
+		if (!Weights.IsValid())
+		{
+			return;
+		}
+
+		auto LlamaDefaultParams = llama_context_default_params();
+		LlamaDefaultParams.n_ctx = 8;
+		LlamaDefaultParams.n_batch = 1;
+
+		if (llama_context* WarmupContext = llama_new_context_with_model(Weights->GetLlamaModel(), LlamaDefaultParams))
+		{
+			const llama_token Token = llama_token_bos(WarmupContext);
+			llama_eval(WarmupContext, &Token, 1, 0, SETTINGS->NThreadToUse);
+			llama_free(WarmupContext);
+		}
+
+		UE_LOG(LogTemp, Log, TEXT("[LLama Integration] The Model was warmed up in %.2fs."), FPlatformTime::Seconds() - StartTime);
+	});
+}
+
+ULlamaModel *ULlamaModel::SetInstance(ULlamaModel* LlamaModel)
+{
+	// The previous model is released: its weights live on in the contexts still using them
+	if (Instance != nullptr && Instance != LlamaModel)
+	{
+		FLlamaModelRegistry::Remove(Instance);
 	}
-	
-	LlamaModel->LlamaModel = LoadedModel;
-	
+
+	Instance = LlamaModel;
 	return LlamaModel;
 }
 
+ULlamaModel *ULlamaModel::LoadModel(const FString& ModelPath, FLlamaModelLoadOptions Options)
+{
+	return SetInstance(FLlamaModelRegistry::FindOrLoad(ModelPath, ModelPath, Options));
+}
+
+ULlamaModel *ULlamaModel::LoadModelWithId(const FString& ModelPath, const FString& ModelId, FLlamaModelLoadOptions Options)
+{
+	return FLlamaModelRegistry::FindOrLoad(ModelId, ModelPath, Options);
+}
+
+ULlamaModel *ULlamaModel::AddLoadedModel(const FString& ModelPath, const FString& ModelId, const FLlamaModelLoadOptions& Options, FLlamaModelWeightsPtr LoadedWeights, bool bMakeCurrent)
+{
+	ULlamaModel *LlamaModel = FLlamaModelRegistry::Register(ModelId.IsEmpty() ? ModelPath : ModelId, ModelPath, Options, MoveTemp(LoadedWeights));
+	return bMakeCurrent ? SetInstance(LlamaModel) : LlamaModel;
+}
+
+FString ULlamaModel::ResolveModelPath(const FString& ModelPath)
+{
+	if (FPaths::FileExists(ModelPath))
+	{
+		return FPaths::ConvertRelativePathToFull(ModelPath);
+	}
+
+	const FString ModelDirectory = FPaths::Combine(FPaths::ProjectDir(), SETTINGS->ModelDirectory);
+	const FString Candidates[] = {
+		FPaths::Combine(FPaths::ProjectDir(), ModelPath),
+		FPaths::Combine(ModelDirectory, ModelPath),
+		FPaths::Combine(ModelDirectory, FPaths::GetCleanFilename(ModelPath))
+	};
+
+	for (const FString& Candidate : Candidates)
+	{
+		if (FPaths::FileExists(Candidate))
+		{
+			return FPaths::ConvertRelativePathToFull(Candidate);
+		}
+	}
+
+	return ModelPath;
+}
+
+ULlamaModel *ULlamaModel::FindModel(const FString& ModelId)
+{
+	return FLlamaModelRegistry::Find(ModelId);
+}
+
+void ULlamaModel::LoadModelInBackground(const FString& ModelPath, const FLlamaModelLoadedDelegate& OnLoaded)
+{
+	FLlamaModelRegistry::MakeRoom(FLlamaModelRegistry::GetModelFileSize(ModelPath));
+
+	Async(EAsyncExecution::Thread, [ModelPath, OnLoaded]()
+	{
+		FLlamaModelWeightsPtr LoadedWeights = FLlamaModelWeights::Load(ModelPath);
+
+		FLlamaStreamDispatcher::RunOnGameThread([ModelPath, LoadedWeights = MoveTemp(LoadedWeights), OnLoaded]() mutable
+		{
+			// A failed load keeps the current model
+			ULlamaModel *LlamaModel = LoadedWeights.IsValid() ? AddLoadedModel(ModelPath, ModelPath, FLlamaModelLoadOptions(), MoveTemp(LoadedWeights), true) : nullptr;
+			OnLoaded.ExecuteIfBound(LlamaModel);
+		});
+	});
+}
+
 void ULlamaModel::FreeModel()
 {
-	
-	if (Instance != nullptr && Instance->LlamaModel != nullptr && !isUnloaded)
-	{
-		isUnloaded = true;
-		// A contest cannot exist without a model. Free all contexts before model
-		 for (auto* Context : ULlamaContextHandler::Contexts)
-		 {
-		 	
-		 	if (Context && !Context->isUnloaded)
-		 	{
-		 		Context->stop = true;
-		 		ULlamaContextHandler::FreeContext(Context);
-		 	}
-		 	
-		 }
-
-		ULlamaContextHandler::Contexts = {};
-		
-		FRWScopeLock Lock(WriteLock, SLT_Write);
-		llama_free_model(Instance->LlamaModel);
-		UE_LOG(LogTemp, Warning, TEXT("[LLama Integration] The Model was unloaded !"));
-		
-	}
-	else if (!isUnloaded)
+	if (Instance != nullptr)
+	{
+		Instance->Unload();
+	}
+	else
 	{
 		UE_LOG(LogTemp, Warning, TEXT("[LLama Integration] Couldn't unload model, model has not been initialized !"));
 	}
-}
\ No newline at end of file
+}
+
+void ULlamaModel::Unload()
+{
+	if (!Weights.IsValid())
+	{
+		return;
+	}
+
+	FreeContexts(false);
+	ULlamaContextHandler::FreePooledContexts(Weights);
+
+	// The weights are freed with their last reference
+	Weights.Reset();
+}
+
+void ULlamaModel::OnEndPIE(bool bIsSimulating)
+{
+#if WITH_EDITOR
+	// The next session finds the model in the registry and skips the load. Its contexts are reset and kept if pooled.
+	if (SETTINGS->bKeepModelsAcrossPIE)
+	{
+		FreeContexts(true);
+		return;
+	}
+#endif
+
+	Unload();
+}
+
+void ULlamaModel::FreeContexts(bool bReturnToPool)
+{
+	// A contest cannot exist without a model. Free the contexts of this model before the model, pooled ones included
+	const TArray<ULlamaContext*> Contexts = ULlamaContextHandler::Contexts;
+	for (auto* Context : Contexts)
+	{
+		if (Context && Context->GetModel() == this)
+		{
+			if (bReturnToPool)
+			{
+				ULlamaContextHandler::FreeContext(Context);
+			}
+			else
+			{
+				ULlamaContextHandler::DestroyContext(Context);
+			}
+		}
+	}
+}
@@ -0,0 +1,102 @@
+﻿// Copyright 2023 Isara Technologies SAS. All Rights Reserved.
+
+#include "LlamaModelLoadAsyncActionNode.h"
+
+#include "Async/Async.h"
+#include "LlamaModelRegistry.h"
+#include "LlamaStreamQueue.h"
+
+ULlamaModelLoadAsyncActionNode* ULlamaModelLoadAsyncActionNode::LoadModelAsync(const FString& ModelPath, const FString& ModelId, bool bMakeCurrent, FLlamaModelLoadOptions Options)
+{
+	ULlamaModelLoadAsyncActionNode* Node = NewObject<ULlamaModelLoadAsyncActionNode>();
+
+	Node->ModelPath = ModelPath;
+	Node->ModelId = ModelId;
+	Node->bMakeCurrent = bMakeCurrent;
+	Node->Options = Options;
+
+	return Node;
+}
+
+void ULlamaModelLoadAsyncActionNode::Cancel()
+{
+	Cancellation->Cancel();
+}
+
+void ULlamaModelLoadAsyncActionNode::Activate()
+{
+	TWeakObjectPtr<ULlamaModelLoadAsyncActionNode> CallingObject(this);
+
+	// Already resident (e.g. kept from the previous Play In Editor session): nothing to read
+	ULlamaModel* Resident = FLlamaModelRegistry::Find(ModelId.IsEmpty() ? ModelPath : ModelId);
+	if (Resident != nullptr && Resident->GetWeights().IsValid() && Resident->GetModelPath() == ModelPath && Resident->GetLoadOptions().IsCompatible(Options))
+	{
+		ULlamaModel* LlamaModel = ULlamaModel::AddLoadedModel(ModelPath, ModelId, Options, Resident->GetWeights(), bMakeCurrent);
+		FLlamaStreamDispatcher::RunOnGameThread([CallingObject, LlamaModel]()
+		{
+			if (ULlamaModelLoadAsyncActionNode* ValidCallingObject = CallingObject.Get())
+			{
+				ValidCallingObject->Progress.Broadcast(1.f);
+				ValidCallingObject->Loaded.Broadcast(LlamaModel);
+				ValidCallingObject->SetReadyToDestroy();
+			}
+		});
+		return;
+	}
+
+	// Idle models are evicted before the load, so the budget holds while both are in memory
+	FLlamaModelRegistry::MakeRoom(FLlamaModelRegistry::GetModelFileSize(ModelPath));
+
+	// The load only works on copies: the node is not touched outside the game thread
+	Async(EAsyncExecution::Thread, [CallingObject, ModelPath = ModelPath, ModelId = ModelId, bMakeCurrent = bMakeCurrent, Options = Options, Cancellation = Cancellation]()
+	{
+		FLlamaModelWeightsPtr LoadedWeights;
+
+		if (!Cancellation->IsCancelled())
+		{
+			// llama reports progress very often: only whole percents are forwarded
+			int32 LastPercent = -1;
+			LoadedWeights = FLlamaModelWeights::Load(ModelPath, Options, [CallingObject, &Cancellation, &LastPercent](float Value)
+			{
+				const int32 Percent = FMath::FloorToInt(Value * 100.f);
+				if (Percent == LastPercent || Cancellation->IsCancelled())
+				{
+					return;
+				}
+				LastPercent = Percent;
+
+				FLlamaStreamDispatcher::RunOnGameThread([CallingObject, Value]()
+				{
+					if (ULlamaModelLoadAsyncActionNode* ValidCallingObject = CallingObject.Get())
+					{
+						ValidCallingObject->Progress.Broadcast(Value);
+					}
+				});
+			});
+		}
+
+		FLlamaStreamDispatcher::RunOnGameThread([CallingObject, ModelPath, ModelId, bMakeCurrent, Options, Cancellation, LoadedWeights = MoveTemp(LoadedWeights)]() mutable
+		{
+			// A cancelled load drops its weights here, they were never shared
+			ULlamaModel* LlamaModel = nullptr;
+			if (LoadedWeights.IsValid() && !Cancellation->IsCancelled())
+			{
+				LlamaModel = ULlamaModel::AddLoadedModel(ModelPath, ModelId, Options, MoveTemp(LoadedWeights), bMakeCurrent);
+			}
+			LoadedWeights.Reset();
+
+			if (ULlamaModelLoadAsyncActionNode* ValidCallingObject = CallingObject.Get())
+			{
+				if (LlamaModel != nullptr)
+				{
+					ValidCallingObject->Loaded.Broadcast(LlamaModel);
+				}
+				else
+				{
+					ValidCallingObject->Failed.Broadcast(nullptr);
+				}
+				ValidCallingObject->SetReadyToDestroy();
+			}
+		});
+	});
+}
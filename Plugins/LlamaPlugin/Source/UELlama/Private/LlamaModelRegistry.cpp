@@ -0,0 +1,205 @@
+﻿// Copyright 2023 Isara Technologies SAS. All Rights Reserved.
+
+#include "LlamaModelRegistry.h"
+
+#include "Async/Async.h"
+#include "HAL/FileManager.h"
+#include "LlamaContextHandler.h"
+#include "LlamaSettings.h"
+#include "LlamaStreamQueue.h"
+
+TMap<FString, ULlamaModel*> FLlamaModelRegistry::Models;
+
+ULlamaModel* FLlamaModelRegistry::FindOrLoad(const FString& ModelId, const FString& ModelPath, const FLlamaModelLoadOptions& Options)
+{
+	ULlamaModel* LlamaModel = Find(ModelId);
+	// Also what keeps a model resident across Play In Editor sessions: the same file with the same options is not loaded again
+	if (LlamaModel != nullptr && LlamaModel->ModelPath == ModelPath && LlamaModel->LoadOptions.IsCompatible(Options))
+	{
+		// A synchronous load was asked for: an evicted model is loaded back here
+		if (!LlamaModel->Weights.IsValid())
+		{
+			MakeRoom(LlamaModel->SizeBytes, LlamaModel);
+			LlamaModel->Weights = FLlamaModelWeights::Load(ModelPath, LlamaModel->LoadOptions);
+		}
+		Touch(LlamaModel);
+		return LlamaModel;
+	}
+
+	MakeRoom(GetModelFileSize(ModelPath) + GetModelFileSize(Options.DraftModelPath));
+	return Register(ModelId, ModelPath, Options, FLlamaModelWeights::Load(ModelPath, Options));
+}
+
+ULlamaModel* FLlamaModelRegistry::Register(const FString& ModelId, const FString& ModelPath, const FLlamaModelLoadOptions& Options, FLlamaModelWeightsPtr Weights)
+{
+	ULlamaModel* LlamaModel = Find(ModelId);
+	if (LlamaModel == nullptr)
+	{
+		LlamaModel = NewObject<ULlamaModel>();
+		LlamaModel->AddToRoot();
+		LlamaModel->ModelId = ModelId;
+		Models.Add(ModelId, LlamaModel);
+	}
+
+	LlamaModel->ModelPath = ModelPath;
+	LlamaModel->LoadOptions = Options;
+	LlamaModel->SizeBytes = GetModelFileSize(ModelPath) + GetModelFileSize(Options.DraftModelPath);
+	LlamaModel->Weights = MoveTemp(Weights);
+	Touch(LlamaModel);
+
+	// Weights loaded on another thread may not have fit the budget
+	MakeRoom(0, LlamaModel);
+	return LlamaModel;
+}
+
+ULlamaModel* FLlamaModelRegistry::Find(const FString& ModelId)
+{
+	ULlamaModel* const* LlamaModel = Models.Find(ModelId);
+	return LlamaModel ? *LlamaModel : nullptr;
+}
+
+FLlamaModelWeightsPtr FLlamaModelRegistry::Acquire(ULlamaModel* Model)
+{
+	if (Model == nullptr)
+	{
+		return nullptr;
+	}
+
+	Touch(Model);
+	if (!Model->Weights.IsValid() && !Model->ModelPath.IsEmpty())
+	{
+		StartReload(Model);
+	}
+	return Model->Weights;
+}
+
+void FLlamaModelRegistry::StartReload(ULlamaModel* Model)
+{
+	if (Model->bReloading)
+	{
+		return;
+	}
+
+	UE_LOG(LogTemp, Log, TEXT("[LLama Integration] Loading back the evicted model %s in the background."), *Model->ModelId);
+	Model->bReloading = true;
+	MakeRoom(Model->SizeBytes, Model);
+
+	TWeakObjectPtr<ULlamaModel> WeakModel = Model;
+	const FString ModelPath = Model->ModelPath;
+	const FLlamaModelLoadOptions Options = Model->LoadOptions;
+
+	Async(EAsyncExecution::Thread, [WeakModel, ModelPath, Options]()
+	{
+		FLlamaModelWeightsPtr LoadedWeights = FLlamaModelWeights::Load(ModelPath, Options);
+
+		FLlamaStreamDispatcher::RunOnGameThread([WeakModel, ModelPath, LoadedWeights = MoveTemp(LoadedWeights)]() mutable
+		{
+			ULlamaModel* LlamaModel = WeakModel.Get();
+			if (LlamaModel == nullptr)
+			{
+				return;
+			}
+			LlamaModel->bReloading = false;
+
+			// Removed, replaced or loaded by someone else meanwhile: these weights are not needed anymore
+			if (Find(LlamaModel->ModelId) != LlamaModel || LlamaModel->ModelPath != ModelPath || LlamaModel->Weights.IsValid())
+			{
+				return;
+			}
+
+			if (!LoadedWeights.IsValid())
+			{
+				UE_LOG(LogTemp, Warning, TEXT("[LLama Integration] Impossible to load back the evicted model %s !"), *LlamaModel->ModelId);
+				return;
+			}
+
+			LlamaModel->Weights = MoveTemp(LoadedWeights);
+			Touch(LlamaModel);
+			MakeRoom(0, LlamaModel);
+		});
+	});
+}
+
+void FLlamaModelRegistry::Touch(ULlamaModel* Model)
+{
+	if (Model)
+	{
+		Model->LastUsedTime = FPlatformTime::Seconds();
+	}
+}
+
+void FLlamaModelRegistry::Remove(ULlamaModel* Model)
+{
+	if (Model == nullptr)
+	{
+		return;
+	}
+
+	if (Find(Model->ModelId) == Model)
+	{
+		Models.Remove(Model->ModelId);
+	}
+
+	Model->Weights.Reset();
+	Model->RemoveFromRoot();
+}
+
+void FLlamaModelRegistry::MakeRoom(int64 Bytes, const ULlamaModel* Keep)
+{
+	const int64 Budget = static_cast<int64>(SETTINGS->ModelMemoryBudgetMB) * 1024 * 1024;
+	if (Budget <= 0)
+	{
+		return;
+	}
+
+	int64 Loaded = GetLoadedBytes();
+	while (Loaded + Bytes > Budget)
+	{
+		// Only the model object and the context pool hold the weights: no context uses them
+		ULlamaModel* Oldest = nullptr;
+		for (const TPair<FString, ULlamaModel*>& Entry : Models)
+		{
+			ULlamaModel* Candidate = Entry.Value;
+			if (Candidate != Keep && Candidate->Weights.IsValid()
+				&& Candidate->Weights.GetSharedReferenceCount() == 1 + ULlamaContextHandler::CountPooledContexts(Candidate->Weights)
+				&& (Oldest == nullptr || Candidate->LastUsedTime < Oldest->LastUsedTime))
+			{
+				Oldest = Candidate;
+			}
+		}
+
+		if (Oldest == nullptr)
+		{
+			UE_LOG(LogTemp, Warning, TEXT("[LLama Integration] The models in use take more than the model memory budget (%d MB) !"), SETTINGS->ModelMemoryBudgetMB);
+			return;
+		}
+
+		UE_LOG(LogTemp, Log, TEXT("[LLama Integration] Evicting the idle model %s to stay in the memory budget."), *Oldest->ModelId);
+		Loaded -= Oldest->SizeBytes;
+		// The pooled contexts of the model go with it: they could only serve its contexts
+		ULlamaContextHandler::FreePooledContexts(Oldest->Weights);
+		Oldest->Weights.Reset();
+	}
+}
+
+int64 FLlamaModelRegistry::GetLoadedBytes()
+{
+	int64 Loaded = 0;
+	for (const TPair<FString, ULlamaModel*>& Entry : Models)
+	{
+		if (Entry.Value->Weights.IsValid())
+		{
+			Loaded += Entry.Value->SizeBytes;
+		}
+	}
+	return Loaded;
+}
+
+int64 FLlamaModelRegistry::GetModelFileSize(const FString& ModelPath)
+{
+	if (ModelPath.IsEmpty())
+	{
+		return 0;
+	}
+	return FMath::Max<int64>(0, IFileManager::Get().FileSize(*ULlamaModel::ResolveModelPath(ModelPath)));
+}
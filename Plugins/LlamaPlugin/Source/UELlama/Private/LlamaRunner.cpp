@@ -2,43 +2,101 @@
 
 #include "LlamaRunner.h"
 #include <string>
-#include <vector>
 
+#include "LlamaContextHandler.h"
 #include "LlamaModel.h"
+#include "LlamaScheduler.h"
 #include "LlamaSettings.h"
+#include "LlamaSpeculation.h"
+#include "LlamaStreamQueue.h"
+#include "Misc/ScopeExit.h"
 
-static std::string llama_token_to_str(const struct llama_context * ctx, llama_token token)
+// Returns the UTF-8 bytes of a token, from the model's piece table or written into Buffer
+static const ANSICHAR* GetTokenPiece(ULlamaContext* Context, llama_token Token, ANSICHAR (&Buffer)[64], int& Len)
 {
-	std::vector<char> result(8, 0);
-	const int n_tokens = llama_token_to_piece(ctx, token, result.data(), result.size());
-	if (n_tokens < 0) {
-		result.resize(-n_tokens);
-		int check = llama_token_to_piece(ctx, token, result.data(), result.size());
-		GGML_ASSERT(check == -n_tokens);
-	} else {
-		result.resize(n_tokens);
+	if (Context->GetWeights().IsValid())
+	{
+		if (const ANSICHAR* Piece = Context->GetWeights()->GetTokenPieces().GetPiece(Token, Len))
+		{
+			return Piece;
+		}
 	}
 
-	return std::string(result.data(), result.size());
+	Len = FMath::Max(0, llama_token_to_piece(Context->GetLlamaContext(), Token, Buffer, UE_ARRAY_COUNT(Buffer)));
+	return Buffer;
 }
 
-bool ULlamaRunner::PrepareEmbeds(ULlamaContext* Context, FString& Prompt)
+// Appends the text of a token to Out, holding back the bytes of a character that is not complete yet
+static void DecodeToken(ULlamaContext* Context, llama_token Token, FString& Out)
 {
-	llama_context *LlamaContext = Context->GetLlamaContext();
-	
-	if (LlamaContext == nullptr)
+	ANSICHAR Buffer[64];
+	int Len = 0;
+	const ANSICHAR* Piece = GetTokenPiece(Context, Token, Buffer, Len);
+	Context->GetUtf8Decoder().Decode(Piece, Len, Out);
+}
+
+// Number of tokens at the start of the last answer whose text fits in its first NCharacters characters
+static int CountTokensInCharacters(ULlamaContext* Context, int NCharacters)
+{
+	const FLlamaTokenHistory& Embeds = Context->GetEmbeds();
+	const int AnswerStart = Embeds.Num() - Context->GetIOSizes().Last();
+	int NChars = 0;
+
+	for (int i = AnswerStart; i < Embeds.Num(); i++)
 	{
-		UE_LOG(LogTemp, Warning, TEXT("[LLama Integration] Impossible to prepare prompt: valid context missing !"));
-		return false;
-	} 
-		
-	Prompt = Context->GetPrefix() + " " + Prompt + " " +Context->GetSuffix();
-	
-	TArray<llama_token> InputEmbeds;
-	std::string Utf8String = TCHAR_TO_UTF8(*Prompt);
-	InputEmbeds.SetNum(Utf8String.length() + 1);
-	
-	const int n = llama_tokenize(LlamaContext, Utf8String.c_str(), InputEmbeds.GetData(), InputEmbeds.Num(), true);
+		ANSICHAR Buffer[64];
+		int Len = 0;
+		const ANSICHAR* Piece = GetTokenPiece(Context, Embeds[i], Buffer, Len);
+
+		// FString characters are UTF-16 code units: one per UTF-8 lead byte, two outside the basic plane
+		for (int j = 0; j < Len; j++)
+		{
+			const uint8 Byte = Piece[j];
+			if ((Byte & 0xC0) != 0x80)
+			{
+				NChars += (Byte & 0xF8) == 0xF0 ? 2 : 1;
+			}
+		}
+
+		if (NChars > NCharacters)
+		{
+			return i - AnswerStart;
+		}
+	}
+	return Embeds.Num() - AnswerStart;
+}
+
+// Evaluates Tokens after the current history, in chunks of BatchSize tokens, checking for a stop request between chunks
+static bool EvaluateTokens(ULlamaContext* Context, const TArray<llama_token>& Tokens)
+{
+	const int NPast = Context->GetEmbeds().Num();
+	const int BatchSize = Context->GetBatchSize();
+
+	for (int32 i = 0; i < Tokens.Num(); i += BatchSize)
+	{
+		if (Context->ShouldStop() || !FLlamaScheduler::YieldPoint())
+		{
+			return false;
+		}
+
+		const int NEval = FMath::Min(BatchSize, Tokens.Num() - i);
+		Context->SetLastEvalSize(NEval);
+		if (llama_eval(Context->GetLlamaContext(), Tokens.GetData() + i, NEval, NPast + i, SETTINGS->NThreadToUse) != 0)
+		{
+			UE_LOG(LogTemp, Warning, TEXT("[LLama Integration] An error happened when evaluating the prompt. "));
+			return false;
+		}
+	}
+	return true;
+}
+
+// Tokenizes a text, returns false if it does not fit in the context
+static bool Tokenize(llama_context* LlamaContext, const FString& Text, bool bAddBos, TArray<llama_token>& OutTokens)
+{
+	std::string Utf8String = TCHAR_TO_UTF8(*Text);
+	OutTokens.SetNum(Utf8String.length() + 1);
+
+	const int n = llama_tokenize(LlamaContext, Utf8String.c_str(), OutTokens.GetData(), OutTokens.Num(), bAddBos);
 	if (n >= llama_n_ctx(LlamaContext) - 4)
 	{
 		UE_LOG(LogTemp, Warning, TEXT("[LLama Integration] Impossible to prepare prompt: input too long ! Please increase context size in the plugin parameters or make your prompt smaller. "));
@@ -51,289 +109,574 @@ bool ULlamaRunner::PrepareEmbeds(ULlamaContext* Context, FString& Prompt)
 		return false;
 	}
 
-	// Assure that input can be added to context. if not, remove some old context information
-	if (Context->GetEmbeds().Num() + n >= llama_n_ctx(LlamaContext) - 4)
-	{
-		UE_LOG(LogTemp, Warning, TEXT("[LLama Integration] Tokenization: Truncating embeds"));
-		int Sum = 0;
-		int i;
+	OutTokens.SetNum(n);
+	return true;
+}
 
-		//Check how many elements must be removed
-		for (i = 0; i < Context->GetIOSizes().Num(); i++)
-		{
-			Sum +=  Context->GetIOSizes()[i];
-			if (Sum >= n) break;
-		}
+// Starts an empty context with its persona prefix, pinned so it survives every window shift.
+// The prefix is evaluated once per model: other contexts copy the state captured after it.
+static bool PreparePrefix(ULlamaContext* Context)
+{
+	llama_context *LlamaContext = Context->GetLlamaContext();
 
-		//Update sizes and remove elements from embeds
-		Context->GetIOSizes().RemoveAt(0, i);
-		Context->GetEmbeds().RemoveAt(0, Sum);
+	TArray<llama_token> PrefixEmbeds;
+	if (!Tokenize(LlamaContext, Context->GetPrefix(), true, PrefixEmbeds))
+	{
+		return false;
 	}
-	
-	InputEmbeds.SetNum(n);
-	Context->GetIOSizes().Add(n);
 
-	TArray<llama_token> TempArray;
+	const int NCtx = llama_n_ctx(LlamaContext);
+	const FLlamaModelWeightsPtr& Weights = Context->GetWeights();
+	// The state of a context keeping every logits row holds n_ctx x n_vocab floats: it is not worth caching
+	const bool bCacheState = Weights.IsValid() && !Weights->ComputesAllLogits();
+	const FLlamaPrefixStateCache::FStatePtr CachedState = bCacheState ? Weights->GetPrefixStates().Find(PrefixEmbeds, NCtx) : nullptr;
 
-	for (int32 i = 0; i < InputEmbeds.Num(); i++)
+	if (CachedState.IsValid())
+	{
+		llama_set_state_data(LlamaContext, const_cast<uint8*>(CachedState->GetData()));
+	}
+	else
 	{
-		if (Context->stop)
+		if (!EvaluateTokens(Context, PrefixEmbeds))
 		{
 			return false;
 		}
-		
-		TempArray.Reset();
-		TempArray.Add(InputEmbeds[i]);
-		llama_eval(LlamaContext, TempArray.GetData(), 1, Context->GetEmbeds().Num() + i, SETTINGS->NThreadToUse);
-		TempArray.Empty();
+
+		if (bCacheState)
+		{
+			// Only the evaluated part of the KV cache is copied: the state is about the size of the prefix
+			TArray64<uint8> State;
+			if (Context->CopyState(State))
+			{
+				Weights->GetPrefixStates().Add(PrefixEmbeds, NCtx, MoveTemp(State));
+			}
+		}
 	}
-	Context->GetEmbeds().Append(InputEmbeds);
+
+	Context->GetIOSizes().Add(PrefixEmbeds.Num());
+	Context->GetEmbeds().Append(PrefixEmbeds);
+	Context->GetEmbeds().Pin(PrefixEmbeds.Num());
+	Context->GetSamplerState().Append(PrefixEmbeds.GetData(), PrefixEmbeds.Num());
 	return true;
 }
 
-FString ULlamaRunner::PredictNextToken(ULlamaContext* Context, bool& EndReached, FLlamaParams Params)
+// Decides whether the prompt block about to be written directly follows the persona prefix, evaluating the prefix if needed.
+// The first prompt of a context starts from the shared persona prefix, the prompt itself follows without a BOS token.
+static bool StartPromptBlock(ULlamaContext* Context, bool& bOutFollowsPrefix)
 {
-    llama_context *LlamaContext = Context->GetLlamaContext();
-    
-    if (LlamaContext == nullptr)
-    {
-        UE_LOG(LogTemp, Warning, TEXT("[LLama Integration] Impossible to apply prediction: valid context missing !"));
-        return FString();
-    }
-    
-    const auto LlamaDefaultParams = llama_context_default_params();
-	
-    FString Prediction;
-	FLlamaParams Parameters = Params;
+	if (Context->EndsWithPartialPrompt())
+	{
+		bOutFollowsPrefix = Context->PartialPromptFollowsPrefix();
+		return true;
+	}
 
-    TArray<llama_token> LastNTokens;
-    LastNTokens.Init(0, LlamaDefaultParams.n_ctx);
+	bOutFollowsPrefix = Context->GetEmbeds().Num() == 0 && !Context->GetPrefix().IsEmpty();
+	return !bOutFollowsPrefix || PreparePrefix(Context);
+}
 
-    llama_token id;
-    
-    auto logits = llama_get_logits(LlamaContext);
-    auto n_vocab = llama_n_vocab(LlamaContext);
+// Writes the first NTokens of Tokens as the prompt block at the end of the history.
+// A partial prompt already there keeps the part that matches: only its divergent end is rolled back and only the rest is evaluated.
+static bool EvaluatePromptBlock(ULlamaContext* Context, const TArray<llama_token>& Tokens, int NTokens)
+{
+	FLlamaTokenHistory& Embeds = Context->GetEmbeds();
+	TArray<int>& IOSizes = Context->GetIOSizes();
 
-    TArray<llama_token_data> Candidates;
-    Candidates.Reserve(n_vocab);
+	int NCommon = 0;
+	if (Context->EndsWithPartialPrompt())
+	{
+		const int Start = Embeds.Num() - IOSizes.Last();
+		while (NCommon < IOSizes.Last() && NCommon < NTokens && Embeds[Start + NCommon] == Tokens[NCommon])
+		{
+			NCommon++;
+		}
 
-    for (llama_token token_id = 0; token_id < n_vocab; token_id++)
-    {
-        Candidates.Add(llama_token_data{token_id, logits[token_id], 0.0f});
-    }
+		// The recognizer revised some words. The last token is evaluated again anyway, for its logits.
+		NCommon = FMath::Max(0, FMath::Min(NCommon, NTokens - 1));
+		Context->TruncateLastBlock(NCommon);
+	}
 
-    llama_token_data_array candidates_p;
-    candidates_p.data = Candidates.GetData();
-    candidates_p.size = Candidates.Num();
-    candidates_p.sorted = false;
+	// Assure that input can be added to context. if not, shift the window past old context information
+	if (!Context->MakeRoom(NTokens - NCommon))
+	{
+		UE_LOG(LogTemp, Warning, TEXT("[LLama Integration] Impossible to prepare prompt: not enough room left in the context window ! "));
+		return false;
+	}
 
-	float NLLogit = logits[llama_token_nl(LlamaContext)];
+	const TArray<llama_token> NewTokens(Tokens.GetData() + NCommon, NTokens - NCommon);
+	if (!EvaluateTokens(Context, NewTokens))
+	{
+		return false;
+	}
+
+	if (Context->EndsWithPartialPrompt())
+	{
+		IOSizes.Last() += NewTokens.Num();
+	}
+	else
+	{
+		IOSizes.Add(NewTokens.Num());
+	}
+	Embeds.Append(NewTokens);
+	Context->GetSamplerState().Append(NewTokens.GetData(), NewTokens.Num());
+	return true;
+}
 
-    int last_n_repeat = std::min(std::min((int)LastNTokens.Num(), Parameters.RepeatLastN), LlamaDefaultParams.n_ctx);
+bool ULlamaRunner::PrepareEmbeds(ULlamaContext* Context, FString& Prompt)
+{
+	llama_context *LlamaContext = Context->GetLlamaContext();
+	
+	if (LlamaContext == nullptr)
+	{
+		UE_LOG(LogTemp, Warning, TEXT("[LLama Integration] Impossible to prepare prompt: valid context missing !"));
+		return false;
+	} 
 
-    llama_sample_frequency_and_presence_penalties(LlamaContext,
-                                                  &candidates_p,
-                                                  LastNTokens.GetData() + LastNTokens.Num() -
-                                                  last_n_repeat,
-                                                  Parameters.RepeatPenalty,
-                                                  Parameters.AlphaFrequency,
-                                                  Parameters.AlphaPresence);
-	if (!Parameters.PenalizeNl)
+	bool bFollowsPrefix = false;
+	if (!StartPromptBlock(Context, bFollowsPrefix))
 	{
-		
-		logits[llama_token_nl(LlamaContext)] = NLLogit;
+		return false;
 	}
 
-	if (Parameters.Temp <= 0)
+	if (bFollowsPrefix)
 	{
-		// Greedy sampling
-		id = llama_sample_token_greedy(LlamaContext, &candidates_p);
+		Prompt = " " + Prompt + " " + Context->GetSuffix();
 	}
 	else
 	{
-		if (Parameters.Mirostat == 1)
-		{
-			static float MirostatMu = 2.0f * Parameters.MirostatTau;
-			llama_sample_temperature(LlamaContext, &candidates_p, Parameters.Temp);
-			id = llama_sample_token_mirostat(LlamaContext, &candidates_p, Parameters.MirostatTau, Parameters.MirostatEta, Parameters.MirostatM, &MirostatMu);
-		}
-		else if (Parameters.Mirostat == 2)
+		Prompt = Context->GetPrefix() + " " + Prompt + " " +Context->GetSuffix();
+	}
+	
+	TArray<llama_token> InputEmbeds;
+	if (!Tokenize(LlamaContext, Prompt, !bFollowsPrefix, InputEmbeds))
+	{
+		return false;
+	}
+
+	// Only what differs from the partial prompt prefilled while the player was talking is evaluated
+	if (!EvaluatePromptBlock(Context, InputEmbeds, InputEmbeds.Num()))
+	{
+		return false;
+	}
+
+	Context->SetPartialPrompt(false, false);
+	Context->SetEndsWithAnswer(false);
+	return true;
+}
+
+void ULlamaRunner::UpdatePartialPrompt(ULlamaContext* Context, FString PartialPrompt)
+{
+	if (Context == nullptr)
+	{
+		return;
+	}
+
+	// Transcripts come faster than they are evaluated: a queued update is skipped when a newer one follows it
+	const int32 Serial = Context->NextPartialPromptSerial();
+	FLlamaScheduler::Submit(Context, static_cast<int32>(ELlamaPriority::PlayerFacing), [Context, Serial, PartialPrompt = MoveTemp(PartialPrompt)]()
+	{
+		if (Context->IsLatestPartialPrompt(Serial))
 		{
-			static float MirostatMu = 2.0f * Parameters.MirostatTau;
-			llama_sample_temperature(LlamaContext, &candidates_p, Parameters.Temp);
-			id = llama_sample_token_mirostat_v2(LlamaContext, &candidates_p, Parameters.MirostatTau, Parameters.MirostatEta, &MirostatMu);
+			PrefillPartialPrompt(Context, PartialPrompt);
 		}
-		else
+	});
+}
+
+void ULlamaRunner::DiscardPartialPrompt(ULlamaContext* Context)
+{
+	if (Context == nullptr)
+	{
+		return;
+	}
+
+	// Queued updates are skipped
+	Context->NextPartialPromptSerial();
+
+	FRWScopeLock ContextLock(Context->GetLock(), SLT_Write);
+	if (Context->EndsWithPartialPrompt())
+	{
+		Context->RollbackToTurnLocked(Context->GetTurnCount() - 1);
+	}
+}
+
+bool ULlamaRunner::PrefillPartialPrompt(ULlamaContext* Context, const FString& PartialPrompt)
+{
+	if (Context == nullptr || (Context->GetLlamaContext() == nullptr && !Context->IsSuspended()))
+	{
+		UE_LOG(LogTemp, Warning, TEXT("[LLama Integration] Impossible to prefill partial prompt: valid context missing !"));
+		return false;
+	}
+
+	FRWScopeLock ContextLock(Context->GetLock(), SLT_Write);
+
+	if (Context->IsSuspended() && !Context->stop && !ULlamaContextHandler::ResumeContext(Context))
+	{
+		UE_LOG(LogTemp, Warning, TEXT("[LLama Integration] Impossible to prefill partial prompt: no free context to restore the conversation !"));
+		return false;
+	}
+	Context->Touch();
+
+	llama_context *LlamaContext = Context->GetLlamaContext();
+	if (LlamaContext == nullptr || Context->stop)
+	{
+		UE_LOG(LogTemp, Warning, TEXT("[LLama Integration] Impossible to prefill partial prompt: the context was freed !"));
+		return false;
+	}
+
+	// The first update starts the turn
+	if (!Context->EndsWithPartialPrompt())
+	{
+		Context->PushTurnCheckpoint();
+	}
+
+	bool bFollowsPrefix = false;
+	TArray<llama_token> InputEmbeds;
+	bool bPrefilled = StartPromptBlock(Context, bFollowsPrefix);
+
+	if (bPrefilled)
+	{
+		// Built like the final prompt, whose suffix is not known to be next yet
+		const FString Prompt = bFollowsPrefix ? " " + PartialPrompt : Context->GetPrefix() + " " + PartialPrompt;
+		bPrefilled = Tokenize(LlamaContext, Prompt, !bFollowsPrefix, InputEmbeds);
+	}
+
+	if (bPrefilled)
+	{
+		// The last token may still merge with the next words of the transcript: it waits for the final prompt
+		bPrefilled = EvaluatePromptBlock(Context, InputEmbeds, FMath::Max(0, InputEmbeds.Num() - 1));
+		if (bPrefilled)
 		{
-			// Temperature sampling
-			llama_sample_top_k(LlamaContext, &candidates_p, Parameters.TopK, 1);
-			llama_sample_tail_free(LlamaContext, &candidates_p, Parameters.TfsZ, 1);
-			llama_sample_typical(LlamaContext, &candidates_p, Parameters.TypicalP, 1);
-			llama_sample_top_p(LlamaContext, &candidates_p, Parameters.TopP, 1);
-			llama_sample_temperature(LlamaContext, &candidates_p, Parameters.Temp);
-			id = llama_sample_token(LlamaContext, &candidates_p);
+			Context->SetPartialPrompt(true, bFollowsPrefix);
+			Context->SetEndsWithAnswer(false);
 		}
 	}
-	
-    if (LastNTokens.Num() > 0)
-    {
-        LastNTokens.RemoveAt(0);
-    }
 
-    LastNTokens.Add(id);
+	// The turn did not start after all
+	if (!bPrefilled && !Context->EndsWithPartialPrompt())
+	{
+		Context->RollbackToTurnLocked(Context->GetTurnCount() - 1);
+	}
+	return bPrefilled;
+}
+
+FString ULlamaRunner::PredictNextToken(ULlamaContext* Context, bool& EndReached, FLlamaParams Params)
+{
+	return PredictNextToken(Context, EndReached, FLlamaSamplerChain::FromParams(Params));
+}
 
-    TArray<llama_token> newEmbds;
-    newEmbds.Add(id);
+FString ULlamaRunner::PredictNextToken(ULlamaContext* Context, bool& EndReached, const FLlamaSamplerChain& Chain, llama_token* OutToken)
+{
+    llama_context *LlamaContext = Context->GetLlamaContext();
     
-    Context->GetEmbeds().Append(newEmbds);
+    if (LlamaContext == nullptr)
+    {
+        UE_LOG(LogTemp, Warning, TEXT("[LLama Integration] Impossible to apply prediction: valid context missing !"));
+        return FString();
+    }
+    
+    FString Prediction;
+	FLlamaSamplerState& SamplerState = Context->GetSamplerState();
+
+    const llama_token id = FLlamaSampler::Sample(LlamaContext, Context->GetLastLogits(), SamplerState, Chain);
+	if (OutToken)
+	{
+		*OutToken = id;
+	}
 	
-	std::string res = llama_token_to_str(LlamaContext, id);
-	FString Utf8 = UTF8_TO_TCHAR(res.c_str());
+    SamplerState.Add(id);
 
+    const int NPast = Context->GetEmbeds().Num();
+    Context->GetEmbeds().Add(id);
+	
 	if (id == llama_token_eos(LlamaContext))
 	{
 		EndReached = true;
+		Context->GetUtf8Decoder().Flush(Prediction);
 	} else
 	{
-		Prediction += Utf8;
+		DecodeToken(Context, id, Prediction);
 	}
 
-	llama_eval(LlamaContext,  newEmbds.GetData(), 1, (int)  Context->GetEmbeds().Num(), SETTINGS->NThreadToUse);
+	Context->SetLastEvalSize(1);
+	llama_eval(LlamaContext, &id, 1, NPast, SETTINGS->NThreadToUse);
 	return Prediction;
 }
 
-FString ULlamaRunner::GetAIAnswer(ULlamaContext* Context, FString Prompt, int AnswerLength, FLlamaParams Params)
+FString ULlamaRunner::GenerateAnswer(ULlamaContext* Context, FString Prompt, int AnswerLength, const FLlamaParams& Params, const FLlamaCancellationPtr& Cancellation, TFunctionRef<void(const FString&, const FString&, llama_token)> OnToken)
 {
 	FString Answer = FString();
 	
-	if (Context == nullptr || Context->GetLlamaContext() == nullptr)
+	if (Context == nullptr || (Context->GetLlamaContext() == nullptr && !Context->IsSuspended()))
 	{
 		UE_LOG(LogTemp, Warning, TEXT("[LLama Integration] Impossible to answer prompt: valid context missing !"));
 		return Answer;
 	}
 	
-	FRWScopeLock ModelLock(ULlamaModel::GetLock(), SLT_ReadOnly);
+	// The context pins the weights of its model: no model lock is needed, so a model swap never waits for answers
 	FRWScopeLock ContextLock(Context->GetLock(), SLT_Write);
 	
+	// A suspended context gets its KV cache back first
+	if (Context->IsSuspended() && !Context->stop && !ULlamaContextHandler::ResumeContext(Context))
+	{
+		UE_LOG(LogTemp, Warning, TEXT("[LLama Integration] Impossible to answer prompt: no free context to restore the conversation !"));
+		return Answer;
+	}
+	Context->Touch();
+
 	llama_context *LlamaContext = Context->GetLlamaContext();
 
+	// The context may have been freed while this request waited for the locks
+	if (LlamaContext == nullptr || Context->stop)
+	{
+		UE_LOG(LogTemp, Warning, TEXT("[LLama Integration] Impossible to answer prompt: the context was freed !"));
+		return Answer;
+	}
+
+	// Cancelled before it started: nothing to do
+	if (Cancellation.IsValid() && Cancellation->IsCancelled())
+	{
+		return Answer;
+	}
+
+	Context->SetCancellation(Cancellation);
+	ON_SCOPE_EXIT
+	{
+		Context->SetCancellation(nullptr);
+	};
+
 	UE_LOG(LogTemp, Warning, TEXT("[LLama Integration] Preparing answer..."));
 
 	if (AnswerLength >= llama_n_ctx(LlamaContext) - 4)
 	{
-		UE_LOG(LogTemp, Warning, TEXT("[LLama Integration] Impossible to answer prompt: output too long !"));
+		UE_LOG(LogTemp, Warning, TEXT("[LLama Integration] Impossible to answer prompt: output too long ! Please increase context size in the plugin parameters or make your answer size smaller."));
 		return Answer;
 	}
 	
+	// The state before the prompt, to retry this turn or branch from it later. A partial prompt already recorded it.
+	if (!Context->EndsWithPartialPrompt())
+	{
+		Context->PushTurnCheckpoint();
+	}
 	bool Prepared = PrepareEmbeds(Context, Prompt);
 
-	if (Prepared)
+	if (!Prepared)
+	{
+		// Nothing of the prompt stays in the history
+		Context->RollbackToTurnLocked(Context->GetTurnCount() - 1);
+	}
+	else
 	{
 
-		if (AnswerLength + Context->GetEmbeds().Num()  >= llama_n_ctx(LlamaContext) - 4)
+		if (!Context->MakeRoom(AnswerLength))
 		{
-			int Sum = 0;
-			int i;
-
-			//Check how many elements must be removed
-			for (i = 0; i < Context->GetIOSizes().Num(); i++)
-			{
-				Sum +=  Context->GetIOSizes()[i];
-				if (Sum >= AnswerLength) break;
-			}
-
-			//Update sizes and remove elements from embeds
-			Context->GetIOSizes().RemoveAt(0, i);
-			Context->GetEmbeds().RemoveAt(0, Sum);
+			UE_LOG(LogTemp, Warning, TEXT("[LLama Integration] Impossible to answer prompt: not enough room left in the context window !"));
+			return Answer;
 		}
 		
+		const FLlamaSamplerChain Chain = FLlamaSamplerChain::FromParams(Params);
+		Context->GetUtf8Decoder().Reset();
 		int i = 0;
 		bool stop = i >= AnswerLength;
-		while (!stop && !Context->stop) {
+
+		// With a draft model or prompt lookup, each step adds every accepted proposal at once
+		const bool bSpeculate = FLlamaSpeculation::CanSpeculate(Context, Chain, Params.DraftTokens, Params.bPromptLookup);
+		TArray<llama_token> StepTokens;
+
+		while (!stop && !Context->ShouldStop() && FLlamaScheduler::YieldPoint()) {
 			bool EndReached = false;
-			FString Prediction = PredictNextToken(Context, EndReached, Params);
-			Answer += Prediction;
-			//UE_LOG(LogTemp, Warning, TEXT("[LLama Integration TEMP] Result: %s"), *Answer);
-			i++;
+
+			if (bSpeculate)
+			{
+				if (!FLlamaSpeculation::Step(Context, Chain, Params.DraftTokens, Params.bPromptLookup, AnswerLength - i, StepTokens))
+				{
+					break;
+				}
+
+				const llama_token Eos = llama_token_eos(LlamaContext);
+				for (const llama_token Token : StepTokens)
+				{
+					FString Prediction;
+					if (Token == Eos)
+					{
+						EndReached = true;
+						Context->GetUtf8Decoder().Flush(Prediction);
+					}
+					else
+					{
+						DecodeToken(Context, Token, Prediction);
+					}
+					Answer += Prediction;
+					OnToken(Answer, Prediction, Token);
+					i++;
+				}
+			}
+			else
+			{
+				llama_token Token;
+				FString Prediction = PredictNextToken(Context, EndReached, Chain, &Token);
+				Answer += Prediction;
+				OnToken(Answer, Prediction, Token);
+				i++;
+			}
 			stop = EndReached || (i >= AnswerLength);
 		}
 
+		// The last token of a speculative step is not in the KV cache yet
+		if (bSpeculate && i > 0)
+		{
+			FLlamaSpeculation::Finish(Context);
+		}
+
+		Context->GetUtf8Decoder().Flush(Answer);
 		Context->GetIOSizes().Add(i);
+		Context->SetEndsWithAnswer(true);
 	}
 	
 	return Answer;
 }
 
+bool ULlamaRunner::InterruptAnswer(ULlamaContext* Context, int32 SpokenCharacters, FString Marker)
+{
+	return CutAnswer(Context, [SpokenCharacters](ULlamaContext* InContext)
+	{
+		return CountTokensInCharacters(InContext, SpokenCharacters);
+	}, Marker);
+}
+
+bool ULlamaRunner::InterruptAnswerAtToken(ULlamaContext* Context, int32 SpokenTokens, FString Marker)
+{
+	return CutAnswer(Context, [SpokenTokens](ULlamaContext*)
+	{
+		return SpokenTokens;
+	}, Marker);
+}
 
-FString ULlamaRunner::GetAIAnswerWithCallback(ULlamaContext* Context, FString Prompt, const FLlamaRequestCallDelegate& Callback,  int AnswerLength, FLlamaParams Params)
+bool ULlamaRunner::CutAnswer(ULlamaContext* Context, TFunctionRef<int(ULlamaContext*)> CountSpokenTokens, const FString& Marker)
 {
-	FString Answer = FString();
-	
-	if (Context == nullptr || Context->GetLlamaContext() == nullptr)
+	if (Context == nullptr)
 	{
-		UE_LOG(LogTemp, Warning, TEXT("[LLama Integration] Impossible to answer prompt: valid context missing !"));
-		return Answer;
+		UE_LOG(LogTemp, Warning, TEXT("[LLama Integration] Impossible to interrupt answer: valid context missing !"));
+		return false;
 	}
 
-	FRWScopeLock ModelLock(ULlamaModel::GetLock(), SLT_ReadOnly);
+	// Waits for the generation, which should have been cancelled when the player interrupted it
 	FRWScopeLock ContextLock(Context->GetLock(), SLT_Write);
-	
-	llama_context *LlamaContext = Context->GetLlamaContext();
 
-	UE_LOG(LogTemp, Warning, TEXT("[LLama Integration] Preparing answer..."));
+	if (!Context->EndsWithAnswer())
+	{
+		UE_LOG(LogTemp, Warning, TEXT("[LLama Integration] Impossible to interrupt answer: the conversation does not end with an answer !"));
+		return false;
+	}
 
-	
-	if (AnswerLength >= llama_n_ctx(LlamaContext) - 4)
+	// The token pieces and the marker evaluation need the KV cache back
+	if (Context->IsSuspended() && !Context->stop && !ULlamaContextHandler::ResumeContext(Context))
 	{
-		UE_LOG(LogTemp, Warning, TEXT("[LLama Integration] Impossible to answer prompt: output too long ! Please increase context size in the plugin parameters or make your answer size smaller."));
-		return Answer;
+		UE_LOG(LogTemp, Warning, TEXT("[LLama Integration] Impossible to interrupt answer: no free context to restore the conversation !"));
+		return false;
 	}
-	
-	bool Prepared = PrepareEmbeds(Context, Prompt);
 
-	if (Prepared)
+	llama_context* LlamaContext = Context->GetLlamaContext();
+	if (LlamaContext == nullptr || Context->stop)
+	{
+		UE_LOG(LogTemp, Warning, TEXT("[LLama Integration] Impossible to interrupt answer: the context was freed !"));
+		return false;
+	}
+	Context->Touch();
+
+	// Everything was spoken: the interruption came after the answer
+	if (Context->TruncateAnswer(CountSpokenTokens(Context)) == 0)
 	{
+		return true;
+	}
+	Context->SetEndsWithAnswer(false);
+
+	if (Marker.IsEmpty())
+	{
+		return true;
+	}
+
+	TArray<llama_token> MarkerEmbeds;
+	if (!Tokenize(LlamaContext, Marker, false, MarkerEmbeds) || !Context->MakeRoom(MarkerEmbeds.Num()) || !EvaluateTokens(Context, MarkerEmbeds))
+	{
+		UE_LOG(LogTemp, Warning, TEXT("[LLama Integration] The answer was cut but its interruption marker could not be added !"));
+		return false;
+	}
+
+	Context->GetIOSizes().Add(MarkerEmbeds.Num());
+	Context->GetEmbeds().Append(MarkerEmbeds);
+	Context->GetSamplerState().Append(MarkerEmbeds.GetData(), MarkerEmbeds.Num());
+	return true;
+}
 
-		if (AnswerLength + Context->GetEmbeds().Num()  >= llama_n_ctx(LlamaContext) - 4)
+FString ULlamaRunner::GetAIAnswer(ULlamaContext* Context, FString Prompt, int AnswerLength, FLlamaParams Params, ULlamaCancellationToken* CancellationToken)
+{
+	return GetAIAnswerCancellable(Context, Prompt, AnswerLength, Params, ULlamaCancellationToken::GetCancellation(CancellationToken));
+}
+
+FString ULlamaRunner::GetAIAnswerWithCallback(ULlamaContext* Context, FString Prompt, const FLlamaRequestCallDelegate& Callback,  int AnswerLength, FLlamaParams Params, ULlamaCancellationToken* CancellationToken)
+{
+	return GetAIAnswerWithCallbackCancellable(Context, Prompt, Callback, AnswerLength, Params, ULlamaCancellationToken::GetCancellation(CancellationToken));
+}
+
+FString ULlamaRunner::GetAIAnswerWithStream(ULlamaContext* Context, FString Prompt, const FLlamaStreamDelegate& Callback, int AnswerLength, FLlamaParams Params, ULlamaCancellationToken* CancellationToken)
+{
+	return GetAIAnswerWithStreamCancellable(Context, Prompt, Callback, AnswerLength, Params, ULlamaCancellationToken::GetCancellation(CancellationToken));
+}
+
+FString ULlamaRunner::GetAIAnswerCancellable(ULlamaContext* Context, FString Prompt, int AnswerLength, const FLlamaParams& Params, const FLlamaCancellationPtr& Cancellation)
+{
+	return GenerateAnswer(Context, Prompt, AnswerLength, Params, Cancellation, [](const FString&, const FString&, llama_token) {});
+}
+
+FString ULlamaRunner::GetAIAnswerWithCallbackCancellable(ULlamaContext* Context, FString Prompt, const FLlamaRequestCallDelegate& Callback, int AnswerLength, const FLlamaParams& Params, const FLlamaCancellationPtr& Cancellation)
+{
+	if (IsInGameThread())
+	{
+		return GenerateAnswer(Context, Prompt, AnswerLength, Params, Cancellation, [&Callback](const FString& Answer, const FString&, llama_token)
 		{
-			UE_LOG(LogTemp, Warning, TEXT("[LLama Integration] Interpretation: Truncating embeds"));
-			int Sum = 0;
-			int i;
+			Callback.ExecuteIfBound(Answer);
+		});
+	}
+
+	// Off the game thread: tokens are queued and delivered once per frame by the stream dispatcher
+	TSharedRef<FLlamaStream, ESPMode::ThreadSafe> Stream = MakeShared<FLlamaStream, ESPMode::ThreadSafe>(Callback);
+	FLlamaStreamDispatcher::Register(Stream);
+
+	FString Answer = GenerateAnswer(Context, Prompt, AnswerLength, Params, Cancellation, [&Stream](const FString&, const FString& Delta, llama_token Token)
+	{
+		Stream->Push(Delta, Token);
+	});
+
+	Stream->Finish();
+	return Answer;
+}
+
+FString ULlamaRunner::GetAIAnswerWithStreamCancellable(ULlamaContext* Context, FString Prompt, const FLlamaStreamDelegate& Callback, int AnswerLength, const FLlamaParams& Params, const FLlamaCancellationPtr& Cancellation)
+{
+	if (IsInGameThread())
+	{
+		// Tokens that produced no text yet (start of a multibyte character) are sent with the next delta
+		TArray<int32> PendingTokens;
 
-			//Check how many elements must be removed
-			for (i = 0; i < Context->GetIOSizes().Num(); i++)
+		return GenerateAnswer(Context, Prompt, AnswerLength, Params, Cancellation, [&Callback, &PendingTokens](const FString& Answer, const FString& Delta, llama_token Token)
+		{
+			PendingTokens.Add(Token);
+			if (!Delta.IsEmpty())
 			{
-				Sum +=  Context->GetIOSizes()[i];
-				if (Sum >= AnswerLength) break;
+				Callback.ExecuteIfBound(Delta, PendingTokens, Answer.Len() - Delta.Len());
+				PendingTokens.Reset();
 			}
+		});
+	}
 
-			//Update sizes and remove elements from embeds
-			Context->GetIOSizes().RemoveAt(0, i);
-			Context->GetEmbeds().RemoveAt(0, Sum);
-		}
-		
-		int i = 0;
-		bool stop = i >= AnswerLength;
-		while (!stop && !Context->stop) {
-			bool EndReached = false;
-			FString Prediction = PredictNextToken(Context, EndReached, Params);
-			Answer += Prediction;
-			//UE_LOG(LogTemp, Warning, TEXT("[LLama Integration TEMP] Result: %s"), *Answer);
-			#if WITH_EDITOR
-				FFunctionGraphTask::CreateAndDispatchWhenReady([Callback, Answer]()
-				   {
-						Callback.ExecuteIfBound(Answer);
-				   }, TStatId(), nullptr, ENamedThreads::GameThread);
-			#else
-				Callback.ExecuteIfBound(Answer);
-			#endif
-			
-			i++;
-			stop = EndReached || (i >= AnswerLength);
-		}
+	// Off the game thread: tokens are queued and delivered once per frame by the stream dispatcher
+	TSharedRef<FLlamaStream, ESPMode::ThreadSafe> Stream = MakeShared<FLlamaStream, ESPMode::ThreadSafe>(Callback);
+	FLlamaStreamDispatcher::Register(Stream);
 
-		Context->GetIOSizes().Add(i);
-	}
-	
+	FString Answer = GenerateAnswer(Context, Prompt, AnswerLength, Params, Cancellation, [&Stream](const FString&, const FString& Delta, llama_token Token)
+	{
+		Stream->Push(Delta, Token);
+	});
+
+	Stream->Finish();
 	return Answer;
 }
@@ -3,8 +3,10 @@
 #include "..\Public\LlamaRunnerAsyncActionNode.h"
 
 #include "LlamaRunner.h"
+#include "LlamaScheduler.h"
+#include "LlamaStreamQueue.h"
 
-ULlamaRunnerAsyncActionNode* ULlamaRunnerAsyncActionNode::GetAIAnswerAsync(ULlamaContext* Context, FString Prompt, int AnswerLength, FLlamaParams Params)
+ULlamaRunnerAsyncActionNode* ULlamaRunnerAsyncActionNode::GetAIAnswerAsync(ULlamaContext* Context, FString Prompt, int AnswerLength, FLlamaParams Params, ULlamaCancellationToken* CancellationToken)
 {
 	ULlamaRunnerAsyncActionNode* Node = NewObject<ULlamaRunnerAsyncActionNode>();
 	
@@ -12,47 +14,32 @@ ULlamaRunnerAsyncActionNode* ULlamaRunnerAsyncActionNode::GetAIAnswerAsync(ULlam
 	Node->Prompt = Prompt;
 	Node->AnswerLength = AnswerLength;
 	Node->Params = Params;
+	Node->CancellationToken = CancellationToken ? CancellationToken : ULlamaCancellationToken::CreateCancellationToken();
 
 	return Node;
 }
 
-void ULlamaRunnerAsyncActionNode::Activate()
-{
-	(new FAutoDeleteAsyncTask<BP_GetAIAnswerAsyncTask>(this))->StartBackgroundTask();
-}
-
-//==============================================================
-BP_GetAIAnswerAsyncTask::BP_GetAIAnswerAsyncTask(ULlamaRunnerAsyncActionNode* BP_TaskInstance)
+void ULlamaRunnerAsyncActionNode::Cancel()
 {
-	CallingObject = TWeakObjectPtr<ULlamaRunnerAsyncActionNode>(BP_TaskInstance);
+	CancellationToken->Cancel();
 }
 
-BP_GetAIAnswerAsyncTask::~BP_GetAIAnswerAsyncTask()
+void ULlamaRunnerAsyncActionNode::Activate()
 {
+	TWeakObjectPtr<ULlamaRunnerAsyncActionNode> CallingObject(this);
 
-	if (CallingObject.IsValid())
+	// The request only works on copies: the node is not touched outside the game thread
+	FLlamaScheduler::Submit(Context, static_cast<int32>(Params.Priority), [CallingObject, Context = Context, Prompt = Prompt, AnswerLength = AnswerLength, Params = Params, Cancellation = CancellationToken->GetCancellation()]()
 	{
-		ULlamaRunnerAsyncActionNode* ValidCallingObject = CallingObject.Get();
-        	if (ValidCallingObject && ValidCallingObject->FinishedWork.IsBound()) {
-        		ValidCallingObject->FinishedWork.Broadcast(Answer);
-        	}
-            
-        	if (ValidCallingObject)
-        	{
-        		ValidCallingObject->SetReadyToDestroy();
-        	}
-	}
-}
+		FString Answer = ULlamaRunner::GetAIAnswerCancellable(Context, Prompt, AnswerLength, Params, Cancellation);
 
-void BP_GetAIAnswerAsyncTask::DoWork()
-{
-	if (CallingObject.IsValid())
-	{
-		ULlamaRunnerAsyncActionNode* ValidCallingObject = CallingObject.Get();
-		if (ValidCallingObject)
+		FLlamaStreamDispatcher::RunOnGameThread([CallingObject, Answer = MoveTemp(Answer)]()
 		{
-			FString Res = ULlamaRunner::GetAIAnswer(ValidCallingObject->Context, ValidCallingObject->Prompt, ValidCallingObject->AnswerLength, ValidCallingObject->Params);
-			Answer = Res;
-		}
-	}
+			if (ULlamaRunnerAsyncActionNode* ValidCallingObject = CallingObject.Get())
+			{
+				ValidCallingObject->FinishedWork.Broadcast(Answer);
+				ValidCallingObject->SetReadyToDestroy();
+			}
+		});
+	});
 }
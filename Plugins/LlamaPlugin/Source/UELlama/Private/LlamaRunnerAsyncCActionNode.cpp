@@ -3,8 +3,10 @@
 #include "..\Public\LlamaRunnerCAsyncActionNode.h"
 
 #include "LlamaRunner.h"
+#include "LlamaScheduler.h"
+#include "LlamaStreamQueue.h"
 
-ULlamaRunnerCAsyncActionNode* ULlamaRunnerCAsyncActionNode::GetAIAnswerWithCallbackAsync(ULlamaContext* Context, FString Prompt, const FLlamaRequestCallDelegate Callback, int AnswerLength, FLlamaParams Params)
+ULlamaRunnerCAsyncActionNode* ULlamaRunnerCAsyncActionNode::GetAIAnswerWithCallbackAsync(ULlamaContext* Context, FString Prompt, const FLlamaRequestCallDelegate Callback, int AnswerLength, FLlamaParams Params, ULlamaCancellationToken* CancellationToken)
 {
 	ULlamaRunnerCAsyncActionNode* Node = NewObject<ULlamaRunnerCAsyncActionNode>();
 	
@@ -13,47 +15,49 @@ ULlamaRunnerCAsyncActionNode* ULlamaRunnerCAsyncActionNode::GetAIAnswerWithCallb
 	Node->Callback = Callback;
 	Node->AnswerLength = AnswerLength;
 	Node->Params = Params;
+	Node->CancellationToken = CancellationToken ? CancellationToken : ULlamaCancellationToken::CreateCancellationToken();
 
 	return Node;
 }
 
-void ULlamaRunnerCAsyncActionNode::Activate()
+ULlamaRunnerCAsyncActionNode* ULlamaRunnerCAsyncActionNode::GetAIAnswerWithStreamAsync(ULlamaContext* Context, FString Prompt, const FLlamaStreamDelegate StreamCallback, int AnswerLength, FLlamaParams Params, ULlamaCancellationToken* CancellationToken)
 {
-	(new FAutoDeleteAsyncTask<BP_GetAIAnswerCAsyncTask>(this))->StartBackgroundTask();
+	ULlamaRunnerCAsyncActionNode* Node = NewObject<ULlamaRunnerCAsyncActionNode>();
+	
+	Node->Context = Context;
+	Node->Prompt = Prompt;
+	Node->StreamCallback = StreamCallback;
+	Node->AnswerLength = AnswerLength;
+	Node->Params = Params;
+	Node->CancellationToken = CancellationToken ? CancellationToken : ULlamaCancellationToken::CreateCancellationToken();
+
+	return Node;
 }
 
-//==============================================================
-BP_GetAIAnswerCAsyncTask::BP_GetAIAnswerCAsyncTask(ULlamaRunnerCAsyncActionNode* BP_TaskInstance)
+void ULlamaRunnerCAsyncActionNode::Cancel()
 {
-	CallingObject = TWeakObjectPtr<ULlamaRunnerCAsyncActionNode>(BP_TaskInstance);
+	CancellationToken->Cancel();
 }
 
-BP_GetAIAnswerCAsyncTask::~BP_GetAIAnswerCAsyncTask()
+void ULlamaRunnerCAsyncActionNode::Activate()
 {
+	TWeakObjectPtr<ULlamaRunnerCAsyncActionNode> CallingObject(this);
 
-	if (CallingObject.IsValid())
+	// The request only works on copies: the node is not touched outside the game thread
+	FLlamaScheduler::Submit(Context, static_cast<int32>(Params.Priority), [CallingObject, Context = Context, Prompt = Prompt, Callback = Callback, StreamCallback = StreamCallback, AnswerLength = AnswerLength, Params = Params, Cancellation = CancellationToken->GetCancellation()]()
 	{
-		ULlamaRunnerCAsyncActionNode* ValidCallingObject = CallingObject.Get();
-        	if (ValidCallingObject && ValidCallingObject->FinishedWork.IsBound()) {
-        		ValidCallingObject->FinishedWork.Broadcast(Answer);
-        	}
-            
-        	if (ValidCallingObject)
-        	{
-        		ValidCallingObject->SetReadyToDestroy();
-        	}
-	}
-}
+		FString Answer = StreamCallback.IsBound()
+			? ULlamaRunner::GetAIAnswerWithStreamCancellable(Context, Prompt, StreamCallback, AnswerLength, Params, Cancellation)
+			: ULlamaRunner::GetAIAnswerWithCallbackCancellable(Context, Prompt, Callback, AnswerLength, Params, Cancellation);
 
-void BP_GetAIAnswerCAsyncTask::DoWork()
-{
-	if (CallingObject.IsValid())
-	{
-		ULlamaRunnerCAsyncActionNode* ValidCallingObject = CallingObject.Get();
-		if (ValidCallingObject)
+		// Runs after the last streamed tokens have been delivered
+		FLlamaStreamDispatcher::RunOnGameThread([CallingObject, Answer = MoveTemp(Answer)]()
 		{
-			FString Res = ULlamaRunner::GetAIAnswerWithCallback(ValidCallingObject->Context, ValidCallingObject->Prompt, ValidCallingObject->Callback, ValidCallingObject->AnswerLength, ValidCallingObject->Params);
-			Answer = Res;
-		}
-	}
+			if (ULlamaRunnerCAsyncActionNode* ValidCallingObject = CallingObject.Get())
+			{
+				ValidCallingObject->FinishedWork.Broadcast(Answer);
+				ValidCallingObject->SetReadyToDestroy();
+			}
+		});
+	});
 }
@@ -0,0 +1,318 @@
+﻿// Copyright 2023 Isara Technologies SAS. All Rights Reserved.
+
+#include "LlamaSampler.h"
+
+#include <algorithm>
+
+#include "LlamaRunner.h"
+
+#if PLATFORM_CPU_X86_FAMILY
+#include <emmintrin.h>
+#elif PLATFORM_CPU_ARM_FAMILY
+#include <arm_neon.h>
+#endif
+
+static_assert(sizeof(llama_token_data) == 3 * sizeof(float), "FillCandidates expects llama_token_data to be three packed 32 bits fields");
+
+FLlamaSamplerChain FLlamaSamplerChain::FromParams(const FLlamaParams& Params)
+{
+	FLlamaSamplerChain Chain;
+
+	Chain.RepeatLastN = Params.RepeatLastN;
+	Chain.RepeatPenalty = Params.RepeatPenalty;
+	Chain.AlphaFrequency = Params.AlphaFrequency;
+	Chain.AlphaPresence = Params.AlphaPresence;
+	Chain.bRepeatPenalty = Params.RepeatLastN != 0 && Params.RepeatPenalty != 1.f;
+	Chain.bFrequencyPresencePenalty = Params.RepeatLastN != 0 && (Params.AlphaFrequency != 0.f || Params.AlphaPresence != 0.f);
+	Chain.bPenalizeNl = Params.PenalizeNl;
+
+	Chain.Temp = Params.Temp;
+	Chain.bTemperature = Params.Temp != 1.f;
+
+	if (Params.Temp <= 0)
+	{
+		Chain.Mode = EMode::Greedy;
+		return Chain;
+	}
+
+	if (Params.Mirostat == 1 || Params.Mirostat == 2)
+	{
+		Chain.Mode = Params.Mirostat == 1 ? EMode::Mirostat : EMode::MirostatV2;
+		Chain.MirostatTau = Params.MirostatTau;
+		Chain.MirostatEta = Params.MirostatEta;
+		Chain.MirostatM = Params.MirostatM;
+		return Chain;
+	}
+
+	Chain.Mode = EMode::Standard;
+	Chain.TopK = FMath::Max(0, Params.TopK);
+	Chain.TfsZ = Params.TfsZ;
+	Chain.bTailFree = Params.TfsZ < 1.f;
+	Chain.TypicalP = Params.TypicalP;
+	Chain.bTypical = Params.TypicalP < 1.f;
+	Chain.TopP = Params.TopP;
+	Chain.bTopP = Params.TopP < 1.f;
+
+	return Chain;
+}
+
+void FLlamaSampler::FillCandidates(const float* Logits, int NVocab, llama_token_data* Out)
+{
+	int i = 0;
+	float* Dst = reinterpret_cast<float*>(Out);
+
+#if PLATFORM_CPU_X86_FAMILY
+	// 4 candidates = 12 floats: [id0 l0 0 id1] [l1 0 id2 l2] [0 id3 l3 0]
+	const __m128 Zero = _mm_setzero_ps();
+	const __m128i Step = _mm_set1_epi32(4);
+	__m128i Ids = _mm_setr_epi32(0, 1, 2, 3);
+
+	for (; i + 4 <= NVocab; i += 4)
+	{
+		const __m128 IdBits = _mm_castsi128_ps(Ids);
+		const __m128 L = _mm_loadu_ps(Logits + i);
+
+		const __m128 Lo = _mm_unpacklo_ps(IdBits, L);	// id0 l0 id1 l1
+		const __m128 Hi = _mm_unpackhi_ps(IdBits, L);	// id2 l2 id3 l3
+
+		const __m128 Out0 = _mm_shuffle_ps(Lo, _mm_unpacklo_ps(Zero, IdBits), _MM_SHUFFLE(3, 0, 1, 0));
+		const __m128 Out1 = _mm_shuffle_ps(_mm_unpacklo_ps(L, Zero), Hi, _MM_SHUFFLE(1, 0, 3, 2));
+		const __m128 Out2 = _mm_shuffle_ps(_mm_unpackhi_ps(Zero, IdBits), _mm_unpackhi_ps(L, Zero), _MM_SHUFFLE(1, 2, 3, 0));
+
+		_mm_storeu_ps(Dst + 3 * i, Out0);
+		_mm_storeu_ps(Dst + 3 * i + 4, Out1);
+		_mm_storeu_ps(Dst + 3 * i + 8, Out2);
+
+		Ids = _mm_add_epi32(Ids, Step);
+	}
+#elif PLATFORM_CPU_ARM_FAMILY
+	const float32x4_t Zero = vdupq_n_f32(0.f);
+	const uint32x4_t Step = vdupq_n_u32(4);
+	const uint32_t FirstIds[4] = {0, 1, 2, 3};
+	uint32x4_t Ids = vld1q_u32(FirstIds);
+
+	for (; i + 4 <= NVocab; i += 4)
+	{
+		float32x4x3_t Interleaved;
+		Interleaved.val[0] = vreinterpretq_f32_u32(Ids);
+		Interleaved.val[1] = vld1q_f32(Logits + i);
+		Interleaved.val[2] = Zero;
+		vst3q_f32(Dst + 3 * i, Interleaved);
+
+		Ids = vaddq_u32(Ids, Step);
+	}
+#endif
+
+	for (; i < NVocab; i++)
+	{
+		Out[i] = llama_token_data{i, Logits[i], 0.0f};
+	}
+}
+
+void FLlamaSampler::ApplyPenalties(float* Logits, FLlamaSamplerState& State, const FLlamaSamplerChain& Chain)
+{
+	int NLast = Chain.RepeatLastN;
+	const llama_token* LastTokens = State.GetLastTokens(NLast);
+	if (NLast <= 0)
+	{
+		return;
+	}
+
+	// Sort a copy of the history so every distinct token is penalized once, with its number of occurrences
+	TArray<llama_token>& Sorted = State.GetPenaltyScratch();
+	Sorted.Reset();
+	Sorted.Append(LastTokens, NLast);
+	Sorted.Sort();
+
+	for (int i = 0; i < Sorted.Num();)
+	{
+		const llama_token Token = Sorted[i];
+		int Count = 0;
+		while (i < Sorted.Num() && Sorted[i] == Token)
+		{
+			Count++;
+			i++;
+		}
+
+		float& Logit = Logits[Token];
+
+		if (Chain.bRepeatPenalty)
+		{
+			Logit = Logit <= 0 ? Logit * Chain.RepeatPenalty : Logit / Chain.RepeatPenalty;
+		}
+
+		if (Chain.bFrequencyPresencePenalty)
+		{
+			Logit -= float(Count) * Chain.AlphaFrequency + Chain.AlphaPresence;
+		}
+	}
+}
+
+void FLlamaSampler::SelectTopK(llama_token_data_array& Candidates, int K)
+{
+	const auto Compare = [](const llama_token_data& A, const llama_token_data& B)
+	{
+		return A.logit > B.logit;
+	};
+
+	llama_token_data* Begin = Candidates.data;
+	llama_token_data* End = Candidates.data + Candidates.size;
+
+	std::nth_element(Begin, Begin + K, End, Compare);
+	std::sort(Begin, Begin + K, Compare);
+
+	Candidates.size = K;
+	Candidates.sorted = true;
+}
+
+void FLlamaSampler::PenalizeLogits(llama_context* Ctx, float* Logits, FLlamaSamplerState& State, const FLlamaSamplerChain& Chain)
+{
+	if (!Chain.bRepeatPenalty && !Chain.bFrequencyPresencePenalty)
+	{
+		return;
+	}
+
+	const llama_token NLToken = llama_token_nl(Ctx);
+	const float NLLogit = Logits[NLToken];
+
+	ApplyPenalties(Logits, State, Chain);
+
+	if (!Chain.bPenalizeNl)
+	{
+		Logits[NLToken] = NLLogit;
+	}
+}
+
+llama_token FLlamaSampler::FindBestToken(const float* Logits, int NVocab)
+{
+	// No candidate needed to find the best logit
+	llama_token Best = 0;
+	for (llama_token i = 1; i < NVocab; i++)
+	{
+		if (Logits[i] > Logits[Best])
+		{
+			Best = i;
+		}
+	}
+	return Best;
+}
+
+void FLlamaSampler::ApplyStandardStages(llama_context* Ctx, llama_token_data_array& Candidates, const FLlamaSamplerChain& Chain)
+{
+	if (Chain.TopK > 0 && Chain.TopK < static_cast<int>(Candidates.size))
+	{
+		SelectTopK(Candidates, Chain.TopK);
+	}
+	if (Chain.bTailFree)
+	{
+		llama_sample_tail_free(Ctx, &Candidates, Chain.TfsZ, 1);
+	}
+	if (Chain.bTypical)
+	{
+		llama_sample_typical(Ctx, &Candidates, Chain.TypicalP, 1);
+	}
+	if (Chain.bTopP)
+	{
+		llama_sample_top_p(Ctx, &Candidates, Chain.TopP, 1);
+	}
+	if (Chain.bTemperature)
+	{
+		llama_sample_temperature(Ctx, &Candidates, Chain.Temp);
+	}
+}
+
+llama_token FLlamaSampler::Sample(llama_context* Ctx, float* Logits, FLlamaSamplerState& State, const FLlamaSamplerChain& Chain)
+{
+	const int NVocab = llama_n_vocab(Ctx);
+
+	PenalizeLogits(Ctx, Logits, State, Chain);
+
+	if (Chain.Mode == FLlamaSamplerChain::EMode::Greedy)
+	{
+		return FindBestToken(Logits, NVocab);
+	}
+
+	llama_token_data_array Candidates;
+	Candidates.data = State.GetCandidateBuffer(NVocab);
+	Candidates.size = NVocab;
+	Candidates.sorted = false;
+
+	FillCandidates(Logits, NVocab, Candidates.data);
+
+	if (Chain.Mode == FLlamaSamplerChain::EMode::Mirostat)
+	{
+		if (Chain.bTemperature)
+		{
+			llama_sample_temperature(Ctx, &Candidates, Chain.Temp);
+		}
+		float& MirostatMu = State.GetMirostatMu(1, Chain.MirostatTau);
+		return llama_sample_token_mirostat(Ctx, &Candidates, Chain.MirostatTau, Chain.MirostatEta, Chain.MirostatM, &MirostatMu);
+	}
+
+	if (Chain.Mode == FLlamaSamplerChain::EMode::MirostatV2)
+	{
+		if (Chain.bTemperature)
+		{
+			llama_sample_temperature(Ctx, &Candidates, Chain.Temp);
+		}
+		float& MirostatMu = State.GetMirostatMu(2, Chain.MirostatTau);
+		return llama_sample_token_mirostat_v2(Ctx, &Candidates, Chain.MirostatTau, Chain.MirostatEta, &MirostatMu);
+	}
+
+	ApplyStandardStages(Ctx, Candidates, Chain);
+	return llama_sample_token(Ctx, &Candidates);
+}
+
+void FLlamaSampler::ComputeDistribution(llama_context* Ctx, float* Logits, FLlamaSamplerState& State, const FLlamaSamplerChain& Chain, llama_token_data_array& Candidates)
+{
+	const int NVocab = llama_n_vocab(Ctx);
+
+	PenalizeLogits(Ctx, Logits, State, Chain);
+
+	Candidates.data = State.GetCandidateBuffer(NVocab);
+	Candidates.sorted = true;
+
+	if (Chain.Mode == FLlamaSamplerChain::EMode::Greedy)
+	{
+		const llama_token Best = FindBestToken(Logits, NVocab);
+		Candidates.data[0] = llama_token_data{Best, Logits[Best], 1.0f};
+		Candidates.size = 1;
+		return;
+	}
+
+	Candidates.size = NVocab;
+	Candidates.sorted = false;
+	FillCandidates(Logits, NVocab, Candidates.data);
+
+	ApplyStandardStages(Ctx, Candidates, Chain);
+	llama_sample_softmax(Ctx, &Candidates);
+}
+
+llama_token FLlamaSampler::SampleFromProbabilities(FLlamaSamplerState& State, const llama_token_data* Candidates, int NCandidates)
+{
+	float Total = 0.f;
+	for (int i = 0; i < NCandidates; i++)
+	{
+		Total += Candidates[i].p;
+	}
+
+	float Draw = State.NextUniform() * Total;
+	for (int i = 0; i < NCandidates; i++)
+	{
+		Draw -= Candidates[i].p;
+		if (Draw < 0.f)
+		{
+			return Candidates[i].id;
+		}
+	}
+
+	// Rounding: the last candidate with a probability
+	for (int i = NCandidates - 1; i > 0; i--)
+	{
+		if (Candidates[i].p > 0.f)
+		{
+			return Candidates[i].id;
+		}
+	}
+	return Candidates[0].id;
+}
@@ -0,0 +1,323 @@
+﻿// Copyright 2023 Isara Technologies SAS. All Rights Reserved.
+
+#include "LlamaScheduler.h"
+
+#include "HAL/RunnableThread.h"
+#include "LlamaContext.h"
+#include "LlamaSettings.h"
+#include "Misc/ScopeLock.h"
+
+FCriticalSection FLlamaScheduler::Lock;
+TArray<FLlamaScheduler::FRequest> FLlamaScheduler::Pending;
+TArray<FLlamaScheduler::FActiveRequest*> FLlamaScheduler::Active;
+TSet<ULlamaContext*> FLlamaScheduler::BusyContexts;
+int32 FLlamaScheduler::Running = 0;
+int32 FLlamaScheduler::IdleWorkers = 0;
+FEvent* FLlamaScheduler::WakeEvent = nullptr;
+FThreadSafeBool FLlamaScheduler::bStopping = false;
+TArray<FLlamaInferenceWorker*> FLlamaScheduler::Workers;
+
+/** The request run by the current worker thread */
+static thread_local void* CurrentRequest = nullptr;
+
+static int32 GetMaxRunning()
+{
+	return FMath::Max(1, SETTINGS->MaxConcurrentEvals);
+}
+
+void FLlamaScheduler::Submit(ULlamaContext* Context, int32 Priority, TUniqueFunction<void()> Work)
+{
+	FScopeLock ScopeLock(&Lock);
+	if (bStopping)
+	{
+		UE_LOG(LogTemp, Warning, TEXT("[LLama Integration] Request dropped: the inference scheduler is shut down !"));
+		return;
+	}
+
+	if (WakeEvent == nullptr)
+	{
+		WakeEvent = FPlatformProcess::GetSynchEventFromPool(false);
+	}
+
+	FRequest Request;
+	Request.Context = Context;
+	Request.Priority = Priority;
+	Request.Work = MoveTemp(Work);
+	Pending.Add(MoveTemp(Request));
+
+	Dispatch();
+}
+
+void FLlamaScheduler::Shutdown()
+{
+	TArray<FLlamaInferenceWorker*> Stopped;
+	{
+		FScopeLock ScopeLock(&Lock);
+		bStopping = true;
+		Pending.Empty();
+		Stopped = MoveTemp(Workers);
+
+		// Parked requests wake up and stop
+		for (FActiveRequest* Request : Active)
+		{
+			Request->ResumeEvent->Trigger();
+		}
+	}
+
+	if (WakeEvent)
+	{
+		// Each trigger wakes one worker
+		for (int32 i = 0; i < Stopped.Num(); i++)
+		{
+			WakeEvent->Trigger();
+		}
+	}
+
+	for (FLlamaInferenceWorker* Worker : Stopped)
+	{
+		Worker->Join();
+		delete Worker;
+	}
+
+	if (WakeEvent)
+	{
+		FPlatformProcess::ReturnSynchEventToPool(WakeEvent);
+		WakeEvent = nullptr;
+	}
+}
+
+int32 FLlamaScheduler::PickRequest()
+{
+	int32 Best = INDEX_NONE;
+	TSet<ULlamaContext*, DefaultKeyFuncs<ULlamaContext*>, TInlineSetAllocator<16>> SeenContexts;
+
+	for (int32 i = 0; i < Pending.Num(); i++)
+	{
+		const FRequest& Request = Pending[i];
+
+		// Only the oldest request of each context can run, and only if the context is free
+		bool bAlreadySeen = false;
+		SeenContexts.Add(Request.Context, &bAlreadySeen);
+		if (bAlreadySeen || BusyContexts.Contains(Request.Context))
+		{
+			continue;
+		}
+
+		if (Best == INDEX_NONE || Request.Priority > Pending[Best].Priority)
+		{
+			Best = i;
+		}
+	}
+
+	return Best;
+}
+
+FLlamaScheduler::FActiveRequest* FLlamaScheduler::PickParked()
+{
+	FActiveRequest* Best = nullptr;
+	for (FActiveRequest* Request : Active)
+	{
+		if (Request->bParked && (Best == nullptr || Request->Priority > Best->Priority))
+		{
+			Best = Request;
+		}
+	}
+	return Best;
+}
+
+void FLlamaScheduler::Dispatch()
+{
+	const int32 MaxRunning = GetMaxRunning();
+	const int32 NextPending = PickRequest();
+
+	// Free slots go to parked requests first, unless a pending request has a strictly higher priority
+	while (Running < MaxRunning)
+	{
+		FActiveRequest* Parked = PickParked();
+		if (Parked == nullptr || (NextPending != INDEX_NONE && Pending[NextPending].Priority > Parked->Priority))
+		{
+			break;
+		}
+
+		Parked->bParked = false;
+		Parked->bYieldRequested = false;
+		Running++;
+		Parked->ResumeEvent->Trigger();
+	}
+
+	if (NextPending == INDEX_NONE)
+	{
+		return;
+	}
+
+	if (Running < MaxRunning)
+	{
+		// Parked requests keep their thread: start another one if every worker is busy.
+		// A free slot means fewer than MaxRunning workers evaluate, the others are parked and must not block the pending request.
+		if (IdleWorkers == 0)
+		{
+			// Counted as idle right away, so that the next dispatches do not start more threads before it runs
+			Workers.Add(new FLlamaInferenceWorker(Workers.Num()));
+			IdleWorkers++;
+		}
+		WakeEvent->Trigger();
+		return;
+	}
+
+	// Every slot is taken: ask the lowest priority running request to make room
+	FActiveRequest* Lowest = nullptr;
+	for (FActiveRequest* Request : Active)
+	{
+		if (!Request->bParked && (Lowest == nullptr || Request->Priority < Lowest->Priority))
+		{
+			Lowest = Request;
+		}
+	}
+
+	if (Lowest && Lowest->Priority < Pending[NextPending].Priority)
+	{
+		Lowest->bYieldRequested = true;
+	}
+}
+
+bool FLlamaScheduler::WaitForRequest(FRequest& OutRequest, FActiveRequest*& OutActive)
+{
+	// The worker was counted as idle when it started or when it completed its last request
+	Lock.Lock();
+
+	while (!bStopping)
+	{
+		const int32 Index = Running < GetMaxRunning() ? PickRequest() : INDEX_NONE;
+		const FActiveRequest* Parked = PickParked();
+
+		if (Index != INDEX_NONE && (Parked == nullptr || Pending[Index].Priority > Parked->Priority))
+		{
+			OutRequest = MoveTemp(Pending[Index]);
+			Pending.RemoveAt(Index);
+
+			OutActive = new FActiveRequest();
+			OutActive->Context = OutRequest.Context;
+			OutActive->Priority = OutRequest.Priority;
+			OutActive->ResumeEvent = FPlatformProcess::GetSynchEventFromPool(false);
+			Active.Add(OutActive);
+
+			BusyContexts.Add(OutRequest.Context);
+			Running++;
+			IdleWorkers--;
+
+			// Let another worker pick what is left
+			Dispatch();
+			Lock.Unlock();
+			return true;
+		}
+
+		Lock.Unlock();
+		WakeEvent->Wait(100);
+		Lock.Lock();
+	}
+
+	IdleWorkers--;
+	Lock.Unlock();
+	return false;
+}
+
+void FLlamaScheduler::CompleteRequest(FActiveRequest* Request)
+{
+	{
+		FScopeLock ScopeLock(&Lock);
+		Running--;
+		IdleWorkers++;
+		BusyContexts.Remove(Request->Context);
+		Active.Remove(Request);
+
+		if (!bStopping)
+		{
+			Dispatch();
+		}
+	}
+
+	FPlatformProcess::ReturnSynchEventToPool(Request->ResumeEvent);
+	delete Request;
+}
+
+bool FLlamaScheduler::YieldPoint()
+{
+	FActiveRequest* Request = static_cast<FActiveRequest*>(CurrentRequest);
+	if (Request == nullptr)
+	{
+		return true;
+	}
+
+	if (Request->bYieldRequested)
+	{
+		{
+			FScopeLock ScopeLock(&Lock);
+			if (bStopping)
+			{
+				return false;
+			}
+
+			UE_LOG(LogTemp, Log, TEXT("[LLama Integration] A request was paused for a higher priority one."));
+			Request->bParked = true;
+			Running--;
+			Dispatch();
+		}
+
+		// Dispatch gives the slot back and triggers the event. A cancelled request stops waiting.
+		while (!Request->ResumeEvent->Wait(10))
+		{
+			if (!Request->Context->ShouldStop())
+			{
+				continue;
+			}
+
+			FScopeLock ScopeLock(&Lock);
+			if (Request->bParked)
+			{
+				// Takes a slot back so that CompleteRequest stays balanced
+				Request->bParked = false;
+				Running++;
+				return false;
+			}
+			// Resumed meanwhile: the event is already triggered
+		}
+	}
+
+	return !bStopping && !Request->Context->ShouldStop();
+}
+
+//==============================================================
+FLlamaInferenceWorker::FLlamaInferenceWorker(int32 Index)
+{
+	Thread = FRunnableThread::Create(this, *FString::Printf(TEXT("LlamaInference%d"), Index), 0, TPri_Normal);
+}
+
+FLlamaInferenceWorker::~FLlamaInferenceWorker()
+{
+	delete Thread;
+}
+
+uint32 FLlamaInferenceWorker::Run()
+{
+	FLlamaScheduler::FRequest Request;
+	FLlamaScheduler::FActiveRequest* ActiveRequest = nullptr;
+
+	while (FLlamaScheduler::WaitForRequest(Request, ActiveRequest))
+	{
+		CurrentRequest = ActiveRequest;
+		Request.Work();
+		Request.Work.Reset();
+		CurrentRequest = nullptr;
+
+		FLlamaScheduler::CompleteRequest(ActiveRequest);
+	}
+	return 0;
+}
+
+void FLlamaInferenceWorker::Join()
+{
+	if (Thread)
+	{
+		Thread->WaitForCompletion();
+	}
+}
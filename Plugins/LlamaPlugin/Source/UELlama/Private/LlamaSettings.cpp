@@ -12,4 +12,11 @@ void ULlamaSettings::Reset()
 {
 	ContextSize = 4096;
 	NThreadToUse = 4;
+	BatchSize = 512;
+	MaxConcurrentEvals = 2;
+	ContextPoolSize = 0;
+	SuspendedContextsRamMB = 512;
+	ModelMemoryBudgetMB = 0;
+	bKeepModelsAcrossPIE = true;
+	ModelDirectory = TEXT("Models");
 }
\ No newline at end of file
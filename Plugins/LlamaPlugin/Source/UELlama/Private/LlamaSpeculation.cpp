@@ -0,0 +1,281 @@
+﻿// Copyright 2023 Isara Technologies SAS. All Rights Reserved.
+
+#include "LlamaSpeculation.h"
+
+#include "LlamaContext.h"
+#include "LlamaSettings.h"
+
+// Reused buffers of the inference thread running a speculative step
+static thread_local TArray<llama_token> Proposals;
+static thread_local TArray<llama_token> Batch;
+static thread_local TArray<float> DraftProbs;
+
+// Lengths of the runs of last tokens looked for in the history by prompt lookup
+static constexpr int MaxLookupNgram = 3;
+static constexpr int MinLookupNgram = 1;
+
+bool FLlamaSpeculation::CanSpeculate(const ULlamaContext* Context, const FLlamaSamplerChain& Chain, int NDraft, bool bPromptLookup)
+{
+	const FLlamaModelWeightsPtr& Weights = Context->GetWeights();
+	const bool bSupportedChain = Chain.Mode == FLlamaSamplerChain::EMode::Greedy || Chain.Mode == FLlamaSamplerChain::EMode::Standard;
+	const bool bHasProposer = Weights.IsValid() && (Weights->GetDraftWeights().IsValid() || (bPromptLookup && Weights->SupportsPromptLookup()));
+
+	if (bPromptLookup && Weights.IsValid() && !Weights->SupportsPromptLookup())
+	{
+		UE_LOG(LogTemp, Warning, TEXT("[LLama Integration] Prompt lookup ignored: the model was not loaded with prompt lookup enabled !"));
+	}
+	return NDraft > 0 && bSupportedChain && bHasProposer;
+}
+
+void FLlamaSpeculation::LookUp(const ULlamaContext* Context, int NDraft, TArray<llama_token>& OutProposals)
+{
+	OutProposals.Reset();
+
+	// Reading the history is const, but its accessor is not
+	const FLlamaTokenHistory& Embeds = const_cast<ULlamaContext*>(Context)->GetEmbeds();
+	const int Num = Embeds.Num();
+
+	for (int N = FMath::Min(MaxLookupNgram, Num - 1); N >= MinLookupNgram; N--)
+	{
+		// The most recent occurrence first: the conversation is more likely to repeat what was just said
+		for (int Start = Num - N - 1; Start >= 0; Start--)
+		{
+			int Matched = 0;
+			while (Matched < N && Embeds[Start + Matched] == Embeds[Num - N + Matched])
+			{
+				Matched++;
+			}
+
+			if (Matched == N)
+			{
+				for (int i = Start + N; i < FMath::Min(Start + N + NDraft, Num); i++)
+				{
+					OutProposals.Add(Embeds[i]);
+				}
+				return;
+			}
+		}
+	}
+}
+
+bool FLlamaSpeculation::SyncDraft(ULlamaContext* Context)
+{
+	llama_context* DraftContext = Context->GetDraftContext();
+	if (DraftContext == nullptr)
+	{
+		auto LlamaDefaultParams = llama_context_default_params();
+		LlamaDefaultParams.n_ctx = llama_n_ctx(Context->GetLlamaContext());
+		LlamaDefaultParams.n_batch = Context->GetMaxBatchSize();
+
+		DraftContext = llama_new_context_with_model(Context->GetWeights()->GetDraftWeights()->GetLlamaModel(), LlamaDefaultParams);
+		if (DraftContext == nullptr)
+		{
+			UE_LOG(LogTemp, Warning, TEXT("[LLama Integration] Error while trying to create a draft context !"));
+			return false;
+		}
+		Context->SetDraftContext(DraftContext);
+	}
+
+	const FLlamaTokenHistory& Embeds = Context->GetEmbeds();
+	TArray<llama_token>& DraftTokens = Context->GetDraftTokens();
+
+	// Everything after the first difference is evaluated again, and the last token at least, for its logits
+	const int NLimit = FMath::Min(DraftTokens.Num(), Embeds.Num() - 1);
+	int NCommon = 0;
+	while (NCommon < NLimit && DraftTokens[NCommon] == Embeds[NCommon])
+	{
+		NCommon++;
+	}
+	DraftTokens.SetNum(NCommon, false);
+
+	const int BatchSize = Context->GetMaxBatchSize();
+	for (int i = NCommon; i < Embeds.Num(); i += BatchSize)
+	{
+		Batch.Reset();
+		for (int j = i; j < FMath::Min(i + BatchSize, Embeds.Num()); j++)
+		{
+			Batch.Add(Embeds[j]);
+		}
+
+		if (Context->ShouldStop() || llama_eval(DraftContext, Batch.GetData(), Batch.Num(), i, SETTINGS->NThreadToUse) != 0)
+		{
+			return false;
+		}
+		DraftTokens.Append(Batch);
+	}
+	return true;
+}
+
+void FLlamaSpeculation::Propose(ULlamaContext* Context, const FLlamaSamplerChain& Chain, int NDraft, TArray<llama_token>& OutProposals, TArray<float>& OutProbs)
+{
+	llama_context* DraftContext = Context->GetDraftContext();
+	TArray<llama_token>& DraftTokens = Context->GetDraftTokens();
+	FLlamaSamplerState& State = Context->GetSamplerState();
+
+	const int NVocab = llama_n_vocab(DraftContext);
+	const bool bGreedy = Chain.Mode == FLlamaSamplerChain::EMode::Greedy;
+	const llama_token Eos = llama_token_eos(DraftContext);
+
+	OutProposals.Reset();
+	if (!bGreedy)
+	{
+		OutProbs.SetNumUninitialized(NDraft * NVocab, false);
+	}
+
+	for (int i = 0; i < NDraft; i++)
+	{
+		// The penalties see the proposals as if they were already accepted
+		llama_token_data_array Candidates;
+		FLlamaSampler::ComputeDistribution(DraftContext, llama_get_logits(DraftContext), State, Chain, Candidates);
+
+		llama_token Token = Candidates.data[0].id;
+		if (!bGreedy)
+		{
+			Token = FLlamaSampler::SampleFromProbabilities(State, Candidates.data, static_cast<int>(Candidates.size));
+
+			float* Probs = OutProbs.GetData() + i * NVocab;
+			FMemory::Memzero(Probs, NVocab * sizeof(float));
+			for (size_t c = 0; c < Candidates.size; c++)
+			{
+				Probs[Candidates.data[c].id] = Candidates.data[c].p;
+			}
+		}
+
+		OutProposals.Add(Token);
+		State.Add(Token);
+
+		if (Token == Eos || i == NDraft - 1 || llama_eval(DraftContext, &Token, 1, DraftTokens.Num(), SETTINGS->NThreadToUse) != 0)
+		{
+			break;
+		}
+		DraftTokens.Add(Token);
+	}
+
+	State.RemoveLast(OutProposals.Num());
+}
+
+bool FLlamaSpeculation::Step(ULlamaContext* Context, const FLlamaSamplerChain& Chain, int NDraft, bool bPromptLookup, int MaxTokens, TArray<llama_token>& OutTokens)
+{
+	OutTokens.Reset();
+
+	llama_context* LlamaContext = Context->GetLlamaContext();
+	FLlamaTokenHistory& Embeds = Context->GetEmbeds();
+	FLlamaSamplerState& State = Context->GetSamplerState();
+
+	const int NVocab = llama_n_vocab(LlamaContext);
+	const bool bGreedy = Chain.Mode == FLlamaSamplerChain::EMode::Greedy;
+	const llama_token Eos = llama_token_eos(LlamaContext);
+
+	// The model adds a token of its own after the proposals, and the batch (last token and proposals) must fit in n_batch
+	NDraft = FMath::Min(NDraft, FMath::Min(MaxTokens, Context->GetMaxBatchSize()) - 1);
+
+	Proposals.Reset();
+	bool bCopied = false;
+
+	if (NDraft > 0 && bPromptLookup && Context->GetWeights()->SupportsPromptLookup())
+	{
+		LookUp(Context, NDraft, Proposals);
+		bCopied = Proposals.Num() > 0;
+	}
+
+	if (!bCopied && NDraft > 0 && Context->GetWeights()->GetDraftWeights().IsValid() && SyncDraft(Context))
+	{
+		Propose(Context, Chain, NDraft, Proposals, DraftProbs);
+	}
+
+	// The last token of the history is evaluated again in front of the proposals: its logits are the distribution of the first one
+	Batch.Reset();
+	Batch.Add(Embeds.Last());
+	Batch.Append(Proposals);
+
+	Context->SetLastEvalSize(Batch.Num());
+	if (llama_eval(LlamaContext, Batch.GetData(), Batch.Num(), Embeds.Num() - 1, SETTINGS->NThreadToUse) != 0)
+	{
+		UE_LOG(LogTemp, Warning, TEXT("[LLama Integration] An error happened when evaluating proposed tokens. "));
+		return false;
+	}
+
+	float* Logits = llama_get_logits(LlamaContext);
+
+	for (int i = 0; i <= Proposals.Num(); i++)
+	{
+		llama_token_data_array Candidates;
+		FLlamaSampler::ComputeDistribution(LlamaContext, Logits + static_cast<size_t>(i) * NVocab, State, Chain, Candidates);
+
+		bool bAccepted = false;
+		llama_token Token = Candidates.data[0].id;
+
+		if (i < Proposals.Num())
+		{
+			const llama_token Proposed = Proposals[i];
+			if (bGreedy)
+			{
+				bAccepted = Proposed == Token;
+			}
+			else
+			{
+				// A copied token was proposed for sure: q is 1 for it and 0 for every other token
+				const float* Probs = bCopied ? nullptr : DraftProbs.GetData() + static_cast<size_t>(i) * NVocab;
+				const auto GetQ = [Probs, Proposed](llama_token Id)
+				{
+					return Probs ? Probs[Id] : (Id == Proposed ? 1.f : 0.f);
+				};
+
+				float P = 0.f;
+				for (size_t c = 0; c < Candidates.size; c++)
+				{
+					if (Candidates.data[c].id == Proposed)
+					{
+						P = Candidates.data[c].p;
+						break;
+					}
+				}
+
+				bAccepted = State.NextUniform() * GetQ(Proposed) < P;
+				if (!bAccepted)
+				{
+					// What the proposer over-proposed is taken out of the model's distribution
+					for (size_t c = 0; c < Candidates.size; c++)
+					{
+						Candidates.data[c].p = FMath::Max(0.f, Candidates.data[c].p - GetQ(Candidates.data[c].id));
+					}
+					Token = FLlamaSampler::SampleFromProbabilities(State, Candidates.data, static_cast<int>(Candidates.size));
+				}
+			}
+
+			if (bAccepted)
+			{
+				Token = Proposed;
+			}
+		}
+		else if (!bGreedy)
+		{
+			// Every proposal was accepted: the logits after the last one give a token for free
+			Token = FLlamaSampler::SampleFromProbabilities(State, Candidates.data, static_cast<int>(Candidates.size));
+		}
+
+		Embeds.Add(Token);
+		State.Add(Token);
+		OutTokens.Add(Token);
+
+		if (!bAccepted || Token == Eos)
+		{
+			break;
+		}
+	}
+
+	return true;
+}
+
+bool FLlamaSpeculation::Finish(ULlamaContext* Context)
+{
+	FLlamaTokenHistory& Embeds = Context->GetEmbeds();
+	if (Embeds.Num() == 0)
+	{
+		return true;
+	}
+
+	const llama_token Last = Embeds.Last();
+	Context->SetLastEvalSize(1);
+	return llama_eval(Context->GetLlamaContext(), &Last, 1, Embeds.Num() - 1, SETTINGS->NThreadToUse) == 0;
+}
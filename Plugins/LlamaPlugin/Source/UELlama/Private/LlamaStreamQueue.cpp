@@ -0,0 +1,130 @@
+﻿// Copyright 2023 Isara Technologies SAS. All Rights Reserved.
+
+#include "LlamaStreamQueue.h"
+
+#include "Misc/ScopeLock.h"
+
+FCriticalSection FLlamaStreamDispatcher::StreamsLock;
+TArray<TSharedRef<FLlamaStream, ESPMode::ThreadSafe>> FLlamaStreamDispatcher::Streams;
+FTSTicker::FDelegateHandle FLlamaStreamDispatcher::TickerHandle;
+TQueue<TUniqueFunction<void()>, EQueueMode::Mpsc> FLlamaStreamDispatcher::GameThreadTasks;
+
+FLlamaStream::FLlamaStream(const FLlamaStreamDelegate& InStreamCallback)
+	: StreamCallback(InStreamCallback)
+{
+}
+
+FLlamaStream::FLlamaStream(const FLlamaRequestCallDelegate& InAnswerCallback)
+	: AnswerCallback(InAnswerCallback)
+{
+}
+
+void FLlamaStream::Push(FString Delta, llama_token Token)
+{
+	FEntry Entry;
+	Entry.Delta = MoveTemp(Delta);
+	Entry.Token = Token;
+
+	// Never waits for the game thread: it may itself be waiting for the context lock held by this generation
+	Queue.Enqueue(MoveTemp(Entry));
+}
+
+void FLlamaStream::Finish()
+{
+	bFinished.store(true, std::memory_order_release);
+}
+
+bool FLlamaStream::Drain()
+{
+	// Read the flag first: everything pushed before Finish is then visible to the dequeue below
+	const bool bWasFinished = bFinished.load(std::memory_order_acquire);
+
+	const int32 Offset = Answer.Len();
+	FEntry Entry;
+	while (Queue.Dequeue(Entry))
+	{
+		Answer += Entry.Delta;
+		PendingTokens.Add(Entry.Token);
+	}
+
+	if (Answer.Len() > Offset)
+	{
+		if (StreamCallback.IsBound())
+		{
+			StreamCallback.Execute(Answer.Mid(Offset), PendingTokens, Offset);
+		}
+		AnswerCallback.ExecuteIfBound(Answer);
+		PendingTokens.Reset();
+	}
+
+	return bWasFinished && Queue.IsEmpty();
+}
+
+void FLlamaStreamDispatcher::Startup()
+{
+	if (!TickerHandle.IsValid())
+	{
+		TickerHandle = FTSTicker::GetCoreTicker().AddTicker(FTickerDelegate::CreateStatic(&FLlamaStreamDispatcher::Tick));
+	}
+}
+
+void FLlamaStreamDispatcher::Shutdown()
+{
+	if (TickerHandle.IsValid())
+	{
+		FTSTicker::GetCoreTicker().RemoveTicker(TickerHandle);
+		TickerHandle.Reset();
+	}
+
+	FScopeLock Lock(&StreamsLock);
+	Streams.Empty();
+	GameThreadTasks.Empty();
+}
+
+void FLlamaStreamDispatcher::Register(const TSharedRef<FLlamaStream, ESPMode::ThreadSafe>& Stream)
+{
+	FScopeLock Lock(&StreamsLock);
+	Streams.Add(Stream);
+}
+
+void FLlamaStreamDispatcher::RunOnGameThread(TUniqueFunction<void()> Task)
+{
+	GameThreadTasks.Enqueue(MoveTemp(Task));
+}
+
+bool FLlamaStreamDispatcher::Tick(float DeltaTime)
+{
+	// Tasks are taken before draining the streams: a worker pushes its last tokens before queuing its completion,
+	// so every token pushed before a task taken here is delivered below, before the task runs.
+	// A task queued while draining waits for the next tick.
+	TArray<TUniqueFunction<void()>> Tasks;
+	TUniqueFunction<void()> Task;
+	while (GameThreadTasks.Dequeue(Task))
+	{
+		Tasks.Add(MoveTemp(Task));
+	}
+
+	// Delegates may register new streams: work on a copy of the list
+	TArray<TSharedRef<FLlamaStream, ESPMode::ThreadSafe>> Current;
+	{
+		FScopeLock Lock(&StreamsLock);
+		Current = Streams;
+	}
+
+	for (const TSharedRef<FLlamaStream, ESPMode::ThreadSafe>& Stream : Current)
+	{
+		if (Stream->Drain())
+		{
+			FScopeLock Lock(&StreamsLock);
+			Streams.Remove(Stream);
+		}
+	}
+
+	// Tasks run after the streams so a request's last tokens are delivered before its completion
+	for (TUniqueFunction<void()>& Pending : Tasks)
+	{
+		Pending();
+	}
+
+	return true;
+}
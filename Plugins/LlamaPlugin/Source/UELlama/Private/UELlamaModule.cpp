@@ -4,7 +4,9 @@
 
 #include "Developer/Settings/Public/ISettingsModule.h"
 #include "Developer/Settings/Public/ISettingsSection.h"
+#include "LlamaScheduler.h"
 #include "LlamaSettings.h"
+#include "LlamaStreamQueue.h"
 #include "Interfaces/IPluginManager.h"
 #include "Misc/Paths.h"
 
@@ -37,12 +39,17 @@ void UELlamaModule::StartupModule()
 	}
 
 	ULlamaSettings::Settings = GetDefault<ULlamaSettings>();
+
+	FLlamaStreamDispatcher::Startup();
 }
 
 void UELlamaModule::ShutdownModule()
 {
 	//todo: free memory
 
+	FLlamaScheduler::Shutdown();
+	FLlamaStreamDispatcher::Shutdown();
+
 	if (LlamaLibrary)
 		FPlatformProcess::FreeDllHandle(LlamaLibrary);
 }
@@ -0,0 +1,76 @@
+﻿// Copyright 2023 Isara Technologies SAS. All Rights Reserved.
+
+#pragma once
+
+#include <atomic>
+
+#include "CoreMinimal.h"
+
+#include "LlamaCancellationToken.generated.h"
+
+/** Thread-safe cancellation flag of a request, shared by the game thread and the inference thread */
+class FLlamaCancellation
+{
+public:
+	void Cancel()
+	{
+		bCancelled.store(true, std::memory_order_relaxed);
+	}
+
+	bool IsCancelled() const
+	{
+		return bCancelled.load(std::memory_order_relaxed);
+	}
+
+private:
+	std::atomic<bool> bCancelled { false };
+};
+
+using FLlamaCancellationPtr = TSharedPtr<FLlamaCancellation, ESPMode::ThreadSafe>;
+
+/**
+ * A handle to cancel one request (or several requests sharing the same token).
+ * The generation checks it between two prefill chunks and between two tokens,
+ * so a cancelled request frees its inference thread within one evaluation.
+ */
+UCLASS(BlueprintType)
+class ULlamaCancellationToken : public UObject
+{
+	GENERATED_BODY()
+
+public:
+
+	/**
+	 * Creates a new token that can be passed to a request, then used to cancel it.
+	 * @return The newly created token
+	 */
+	UFUNCTION(BlueprintCallable, Category="LlamaIntegration")
+	static ULlamaCancellationToken* CreateCancellationToken();
+
+	/**
+	 * Cancels the requests using this token. Tokens already generated are kept.
+	 */
+	UFUNCTION(BlueprintCallable, Category="LlamaIntegration")
+	void Cancel();
+
+	/**
+	 * Returns whether Cancel was called on this token.
+	 */
+	UFUNCTION(BlueprintCallable, BlueprintPure, Category="LlamaIntegration")
+	bool IsCancelled() const;
+
+	/** The flag checked by the inference thread. Outlives the token object. */
+	const FLlamaCancellationPtr& GetCancellation() const
+	{
+		return Cancellation;
+	}
+
+	/** Returns the flag of Token, or null if there is no token */
+	static FLlamaCancellationPtr GetCancellation(const ULlamaCancellationToken* Token)
+	{
+		return Token ? Token->Cancellation : FLlamaCancellationPtr();
+	}
+
+private:
+	FLlamaCancellationPtr Cancellation = MakeShared<FLlamaCancellation, ESPMode::ThreadSafe>();
+};
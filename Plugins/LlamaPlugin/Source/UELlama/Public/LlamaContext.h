@@ -2,11 +2,26 @@
 
 #pragma once
 
+#include <atomic>
+
 #include "llama.h"
+#include "LlamaCancellationToken.h"
 #include "LlamaModel.h"
+#include "LlamaSamplerState.h"
+#include "LlamaTokenHistory.h"
 
 #include "LlamaContext.generated.h"
 
+/** The state of a context at the start of a turn, to roll the conversation back to it */
+struct FLlamaTurnCheckpoint
+{
+	/** Number of tokens in the history (n_past) before the prompt of the turn */
+	int NPast = 0;
+
+	/** Penalty history and mirostat state before the prompt of the turn */
+	FLlamaSamplerState::FCheckpoint Sampler;
+};
+
 UCLASS(BlueprintType)
 class ULlamaContext : public UObject
 {
@@ -28,11 +43,114 @@ public:
 		this->LlamaContext = Context;
 	}
 
-	TArray<llama_token> &GetEmbeds()
+	FLlamaTokenHistory &GetEmbeds()
 	{
 		return Embeds;
 	}
 	
+	/** The model this context was created from */
+	ULlamaModel* GetModel() const
+	{
+		return Model;
+	}
+
+	/** Binds the context to a model and takes a reference on its weights */
+	void SetModel(ULlamaModel* InModel)
+	{
+		Model = InModel;
+		Weights = InModel ? InModel->GetWeights() : nullptr;
+	}
+
+	/** The weights this context was created from. They stay loaded while the context holds them. */
+	const FLlamaModelWeightsPtr& GetWeights() const
+	{
+		return Weights;
+	}
+
+	/** Gives the llama context away (e.g. back to the pool) and releases the weights. Requires the write lock. */
+	llama_context* DetachLlamaContext()
+	{
+		llama_context* Detached = LlamaContext;
+		LlamaContext = nullptr;
+		ReleaseDraftContext();
+		Weights.Reset();
+		return Detached;
+	}
+
+	/** Frees the llama context, then releases the weights. Requires the write lock. */
+	void ReleaseLlamaContext();
+
+	/** The context of the draft model mirroring this conversation (see FLlamaSpeculation), null until first used */
+	llama_context* GetDraftContext() const
+	{
+		return DraftContext;
+	}
+
+	void SetDraftContext(llama_context* InDraftContext)
+	{
+		DraftContext = InDraftContext;
+	}
+
+	/** The tokens held in the KV cache of the draft context */
+	TArray<llama_token>& GetDraftTokens()
+	{
+		return DraftTokens;
+	}
+
+	/** Frees the draft context. It is created again, and catches up with the history, on the next speculative answer. */
+	void ReleaseDraftContext()
+	{
+		if (DraftContext != nullptr)
+		{
+			llama_free(DraftContext);
+			DraftContext = nullptr;
+		}
+		DraftTokens.Reset();
+	}
+
+	/** Records the number of tokens of an evaluation of the llama context, to find the logits of its last token */
+	void SetLastEvalSize(int NTokens)
+	{
+		LastEvalSize = NTokens;
+	}
+
+	/** The logits of the last evaluated token. When the model computes all logits, they are in the last row of the last evaluation. */
+	float* GetLastLogits() const
+	{
+		float* Logits = llama_get_logits(LlamaContext);
+		if (Weights.IsValid() && Weights->ComputesAllLogits())
+		{
+			Logits += static_cast<size_t>(FMath::Max(0, LastEvalSize - 1)) * llama_n_vocab(LlamaContext);
+		}
+		return Logits;
+	}
+
+	/**
+	 * Seeds the random draws of sampling on this context: llama's own and those of speculative decoding,
+	 * so that answers can be reproduced. A new context gets a random seed.
+	 * @param InSeed - The seed
+	 */
+	UFUNCTION(BlueprintCallable, Category = "LlamaIntegration")
+	void SetSeed(int32 InSeed);
+
+	/** The seed of the random draws of sampling on this context */
+	UFUNCTION(BlueprintCallable, BlueprintPure, Category = "LlamaIntegration")
+	int32 GetSeed() const
+	{
+		return static_cast<int32>(Seed);
+	}
+
+	/** Decoder holding the bytes of a character split over several generated tokens */
+	FLlamaUtf8Decoder &GetUtf8Decoder()
+	{
+		return Utf8Decoder;
+	}
+
+	FLlamaSamplerState &GetSamplerState()
+	{
+		return SamplerState;
+	}
+
 	TArray<int> &GetIOSizes()
 	{
 		return IOSizes;
@@ -43,18 +161,236 @@ public:
 		return Prefix;
 	}
 
+	void SetPrefix(const FString& InPrefix)
+	{
+		Prefix = InPrefix;
+	}
+
 	FString GetSuffix()
 	{
 		return Suffix;
 	}
 
+	void SetSuffix(const FString& InSuffix)
+	{
+		Suffix = InSuffix;
+	}
+
 	FRWLock& GetLock()
 	{
 		return WriteLock;
 	}
 
-	//To stop current generation if needed
-	bool stop = false;
+	int GetBatchSize() const
+	{
+		return BatchSize;
+	}
+
+	void SetBatchSize(int Size)
+	{
+		BatchSize = FMath::Clamp(Size, 1, MaxBatchSize);
+	}
+
+	int GetMaxBatchSize() const
+	{
+		return MaxBatchSize;
+	}
+
+	void SetMaxBatchSize(int Size)
+	{
+		MaxBatchSize = FMath::Max(1, Size);
+		BatchSize = FMath::Min(BatchSize, MaxBatchSize);
+	}
+
+	/**
+	 * Makes sure NTokens more tokens fit in the context window.
+	 * If they don't, the oldest unpinned blocks of the history are discarded and the kept tail
+	 * is re-evaluated right after the pinned prefix, so the KV cache always matches GetEmbeds().
+	 * @param NTokens - The number of tokens about to be evaluated
+	 * @return Whether there is enough room for the tokens
+	 */
+	bool MakeRoom(int NTokens);
+
+	/** Shortens the last blocks of IOSizes so that they add up to the size of the history */
+	void SyncIOSizes();
+
+	/**
+	 * Copies the state of the llama context (llama_copy_state_data): the evaluated part of the KV cache, the logits and the rng.
+	 * The copy is shrunk to what was written, llama needs room for a whole KV cache while copying. Requires the write lock.
+	 * @param OutState - Receives the state, empty on failure
+	 * @return Whether the state was copied
+	 */
+	bool CopyState(TArray64<uint8>& OutState) const;
+
+	/**
+	 * Saves the conversation of this context in the save game folder: its tokens, their blocks, the turns to roll back to,
+	 * the prefix and suffix and the KV cache itself, so loading it back needs no evaluation. Waits for the running generation, if any.
+	 * @param SlotName - The name of the save
+	 * @return Whether the conversation was saved
+	 */
+	UFUNCTION(BlueprintCallable, Category = "LlamaIntegration")
+	bool SaveConversation(const FString& SlotName);
+
+	/**
+	 * Replaces the conversation of this context with a saved one. The KV cache is restored as it was saved, nothing is evaluated.
+	 * The save must come from a context of the same model. Waits for the running generation, if any.
+	 * @param SlotName - The name of the save
+	 * @return Whether the conversation was loaded. If not, the context is left empty.
+	 */
+	UFUNCTION(BlueprintCallable, Category = "LlamaIntegration")
+	bool LoadConversation(const FString& SlotName);
+
+	/**
+	 * Forgets the conversation so the context can be reused: the history, the sampler state, the prefix and suffix.
+	 * The KV cache is kept allocated, the next evaluation simply starts again at n_past = 0. Requires the write lock.
+	 */
+	void ResetState();
+
+	/** Number of turns (prompt and answer) this context can be rolled back to */
+	UFUNCTION(BlueprintCallable, BlueprintPure, Category = "LlamaIntegration")
+	int32 GetTurnCount() const
+	{
+		return Checkpoints.Num();
+	}
+
+	/**
+	 * Rolls the conversation back to the start of a turn, as if it and every later turn never happened.
+	 * Nothing is evaluated: the history and the sampler state are cut back and the next prompt overwrites the KV cache
+	 * from there, so retrying an answer or branching the dialogue only costs the new tokens. Waits for the running generation, if any.
+	 * @param Turn - The index of the turn to remove, from 0 (the first turn of the conversation) to GetTurnCount() - 1
+	 * @return Whether the context was rolled back
+	 */
+	UFUNCTION(BlueprintCallable, Category = "LlamaIntegration")
+	bool RollbackToTurn(int32 Turn);
+
+	/** Records the state of the context at the start of a new turn. Requires the write lock. */
+	void PushTurnCheckpoint();
+
+	/** Same as RollbackToTurn, for a caller that already holds the write lock */
+	bool RollbackToTurnLocked(int32 Turn);
+
+	/** Whether the last block of the history is a generated answer, the one an interruption cuts */
+	bool EndsWithAnswer() const
+	{
+		return bEndsWithAnswer;
+	}
+
+	void SetEndsWithAnswer(bool bInEndsWithAnswer)
+	{
+		bEndsWithAnswer = bInEndsWithAnswer;
+	}
+
+	/** Whether the last block of the history is a prompt still being transcribed (see ULlamaRunner::UpdatePartialPrompt) */
+	bool EndsWithPartialPrompt() const
+	{
+		return bEndsWithPartialPrompt;
+	}
+
+	/** Whether that prompt directly follows the persona prefix, without a BOS token */
+	bool PartialPromptFollowsPrefix() const
+	{
+		return bPartialPromptFollowsPrefix;
+	}
+
+	void SetPartialPrompt(bool bInEndsWithPartialPrompt, bool bInFollowsPrefix)
+	{
+		bEndsWithPartialPrompt = bInEndsWithPartialPrompt;
+		bPartialPromptFollowsPrefix = bInFollowsPrefix;
+	}
+
+	/** Returns the serial number of a new partial prompt update. Can be called from any thread. */
+	int32 NextPartialPromptSerial()
+	{
+		return ++PartialPromptSerial;
+	}
+
+	/** Whether no partial prompt update was requested after the one with this serial number */
+	bool IsLatestPartialPrompt(int32 Serial) const
+	{
+		return PartialPromptSerial == Serial;
+	}
+
+	/**
+	 * Keeps the first NKept tokens of the last block of the history and drops the others, without any evaluation:
+	 * the next evaluation overwrites the KV cache past the kept tokens. The block stays, even if empty. Requires the write lock.
+	 * @return The number of tokens removed
+	 */
+	int TruncateLastBlock(int NKept);
+
+	/**
+	 * Cuts the last answer after its first NSpoken tokens, as if the rest had never been generated.
+	 * Nothing is evaluated: the next evaluation overwrites the KV cache past the kept tokens. Requires the write lock.
+	 * @param NSpoken - The number of answer tokens to keep
+	 * @return The number of tokens removed, 0 if the history does not end with an answer
+	 */
+	int TruncateAnswer(int NSpoken);
+
+	/** Whether the KV cache of this context is swapped out (see ULlamaContextHandler::SuspendContext) */
+	bool IsSuspended() const
+	{
+		return bSuspended;
+	}
+
+	/** When this context last ran a request, to suspend the least recently used first */
+	double GetLastUsedTime() const
+	{
+		return LastUsedTime;
+	}
+
+	void Touch()
+	{
+		LastUsedTime = FPlatformTime::Seconds();
+	}
+
+	/**
+	 * Compresses the KV cache in RAM and gives the llama context away. Requires the write lock.
+	 * @return The llama context, free to be used by another context of the same model. Null if the context could not be suspended.
+	 */
+	llama_context* Suspend();
+
+	/**
+	 * Restores the KV cache saved by Suspend into a free llama context of the same model. Requires the write lock.
+	 * @param FreeContext - The llama context to use from now on
+	 * @return Whether the KV cache was restored. If not, the conversation is lost: the next prompt starts again from the prefix.
+	 */
+	bool Resume(llama_context* FreeContext);
+
+	using FSnapshotPtr = TSharedPtr<const TArray64<uint8>, ESPMode::ThreadSafe>;
+
+	/** Size of the compressed KV cache held in RAM, 0 if there is none. Requires ULlamaContextHandler's PoolLock. */
+	int64 GetSnapshotRamSize() const
+	{
+		return Snapshot.IsValid() ? Snapshot->Num() : 0;
+	}
+
+	/** The compressed KV cache held in RAM, null if there is none. Requires ULlamaContextHandler's PoolLock. */
+	FSnapshotPtr GetSnapshot() const
+	{
+		return Snapshot;
+	}
+
+	/**
+	 * Drops the compressed KV cache from RAM once it was written to a file. Requires ULlamaContextHandler's PoolLock.
+	 * @param Spilled - The snapshot written to the file
+	 * @param File - The file holding it
+	 * @return False if the context resumed or was reset since, the file is then of no use
+	 */
+	bool SetSnapshotFile(const FSnapshotPtr& Spilled, const FString& File);
+
+	/** Sets the cancellation flag of the request running on this context (null when idle) */
+	void SetCancellation(const FLlamaCancellationPtr& InCancellation)
+	{
+		Cancellation = InCancellation;
+	}
+
+	/** Whether the running generation must stop: the context is being unloaded or the request was cancelled */
+	bool ShouldStop() const
+	{
+		return stop || (Cancellation.IsValid() && Cancellation->IsCancelled());
+	}
+
+	//To stop current generation when the context is unloaded
+	std::atomic<bool> stop { false };
 
 	//Check if llama memory has already been destroyed
 	bool isUnloaded = false;
@@ -63,27 +399,81 @@ public:
 private:
 	llama_context *LlamaContext;
 	
-	/** List of embeds: every token, words, information treated by Llama */
-	TArray<llama_token> Embeds = {};
+	/** List of embeds: every token, words, information treated by Llama (i.e. the content of the KV cache) */
+	FLlamaTokenHistory Embeds;
+
+	/** Reused buffer holding the tail re-evaluated when the window shifts */
+	TArray<llama_token> ShiftScratch;
 	
+	UPROPERTY()
+	ULlamaModel* Model = nullptr;
+
+	/** Reference pinning the weights of Model, released when the context is freed */
+	FLlamaModelWeightsPtr Weights;
+
+	FLlamaUtf8Decoder Utf8Decoder;
+
+	/** Penalty history and mirostat state used when sampling on this context */
+	FLlamaSamplerState SamplerState;
+
+	uint32 Seed = 0;
+
+	/** Draft model context, only used for speculative answers */
+	llama_context* DraftContext = nullptr;
+
+	/** The tokens held in the KV cache of DraftContext, compared with the history to only evaluate what changed */
+	TArray<llama_token> DraftTokens;
+
+	/** Number of tokens of the last evaluation of the llama context */
+	int LastEvalSize = 1;
+
 	/** A list of the size of the blocks of information added in the context (tokens from user prompts or generated by Llama) */
 	TArray<int> IOSizes = {};
 
 	FString Prefix = FString();
 	FString Suffix = FString();
 
-	FRWLock WriteLock;
-};
+	/** Number of prompt tokens evaluated per llama_eval call during prefill */
+	int BatchSize = 512;
 
+	/** The n_batch the llama context was created with: a prefill chunk can never be larger */
+	int MaxBatchSize = 512;
 
-inline ULlamaContext::~ULlamaContext()
-{
-	stop = true;
-	FRWScopeLock ContextLock = FRWScopeLock(WriteLock, SLT_Write);
-	if (this && !isUnloaded)
-	{
-		isUnloaded = true;
-		llama_free(LlamaContext);
-		UE_LOG(LogTemp, Warning, TEXT("[LLama Integration] A Context was unloaded !"));
-	}
-}
+	/** Cancellation of the request currently running on this context */
+	FLlamaCancellationPtr Cancellation;
+
+	bool bEndsWithAnswer = false;
+	bool bEndsWithPartialPrompt = false;
+	bool bPartialPromptFollowsPrefix = false;
+	std::atomic<int32> PartialPromptSerial { 0 };
+
+	/** The state at the start of each turn still in the history, oldest first */
+	TArray<FLlamaTurnCheckpoint> Checkpoints;
+
+	/** Shifts the checkpoints after NDiscard tokens were discarded at NKeep, and drops those that fell in the discarded range */
+	void ShiftCheckpoints(int NKeep, int NDiscard);
+
+	/** Drops the checkpoints past the end of the history */
+	void TrimCheckpoints();
+
+	/** Forgets the history and the sampler state, but keeps the persona (prefix and suffix) and the settings of the context */
+	void ResetConversation();
+
+	/** Frees the compressed KV cache, in RAM or on disk. Takes ULlamaContextHandler's PoolLock. */
+	void DiscardSnapshot();
+
+	bool bSuspended = false;
+
+	std::atomic<double> LastUsedTime { 0.0 };
+
+	/** The compressed KV cache of a suspended context, null once spilled to SnapshotFile. Guarded by ULlamaContextHandler's PoolLock, as SnapshotRawSize and SnapshotFile. */
+	FSnapshotPtr Snapshot;
+
+	/** Size of the KV cache before compression */
+	int64 SnapshotRawSize = 0;
+
+	/** File holding the compressed KV cache after a spill */
+	FString SnapshotFile;
+
+	FRWLock WriteLock;
+};
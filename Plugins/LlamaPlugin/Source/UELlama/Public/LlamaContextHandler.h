@@ -15,8 +15,11 @@ class ULlamaContextHandler : public UObject
 public:
 
 	/**
-	 * Creates a new context by using an existing model.
-	 * @param Model - The model to use 
+	 * Creates a new context by using an existing model. The context keeps using this model until it is freed.
+	 * With a context pool (see plugin settings), the memory of a freed context is reused. When the pool is exhausted,
+	 * the least recently used idle context is suspended to make room, and null is returned if every context is busy.
+	 * @param Model - The model to use. If it was evicted, it is loaded back in the background and null is returned:
+	 * call again once ULlamaModel::IsLoaded returns true.
 	 * @return The newly created model
 	 */
 	UFUNCTION(BlueprintCallable, Category="LlamaIntegration")
@@ -24,11 +27,59 @@ public:
 
 	/**
 	 * Unloads an existing context from memory.
+	 * With a context pool (see plugin settings), its memory goes back to the pool instead and stays allocated.
 	 * @param Context - The context to unload
 	 */
 	UFUNCTION(BlueprintCallable, Category="LlamaIntegration")
 	static void FreeContext(ULlamaContext* Context);
 
+	/**
+	 * Creates the contexts of the pool of a model up front, e.g. during a loading screen.
+	 * @param Model - The model to create contexts for. If it was evicted, it is loaded back in the background and nothing is created.
+	 * @return The number of free contexts of the model in the pool
+	 */
+	UFUNCTION(BlueprintCallable, Category="LlamaIntegration")
+	static int FillContextPool(ULlamaModel* Model);
+
+	/**
+	 * Swaps the KV cache of an idle context out: it is compressed in RAM (or on disk past the budget of the plugin settings)
+	 * and its memory goes back to the pool. The conversation is restored on the next request, or by PrefetchContext.
+	 * Waits for the running generation, if any.
+	 * @param Context - The context to suspend
+	 * @return Whether the context was suspended
+	 */
+	UFUNCTION(BlueprintCallable, Category="LlamaIntegration")
+	static bool SuspendContext(ULlamaContext* Context);
+
+	/**
+	 * Restores a suspended context in the background, e.g. when the player gets close to its NPC,
+	 * so the next request does not wait for it.
+	 * @param Context - The context to restore
+	 */
+	UFUNCTION(BlueprintCallable, Category="LlamaIntegration")
+	static void PrefetchContext(ULlamaContext* Context);
+
+	/**
+	 * Restores a suspended context now. Does nothing if it is not suspended. Requires the write lock of the context.
+	 * @return Whether the context has a llama context to run on
+	 */
+	static bool ResumeContext(ULlamaContext* Context);
+
+	/** Frees the memory of a context, suspended or not */
+	static void DestroyContext(ULlamaContext* Context);
+
+	/** Frees the pooled memory kept for the contexts of a model */
+	static void FreePooledContexts(const FLlamaModelWeightsPtr& Weights);
+
+	/** Number of free llama contexts of a model in the pool, each holding a reference on its weights */
+	static int CountPooledContexts(const FLlamaModelWeightsPtr& Weights);
+
+	/** Removes a context from Contexts */
+	static void UnlistContext(ULlamaContext* Context);
+
+	/** Frees a llama context given by TakeLlamaContext, instead of returning it to the pool */
+	static void ReleaseLlamaContext(const FLlamaModelWeightsPtr& Weights, llama_context* LlamaContext);
+
 	/**
 	 * Adds a prefix to the user's prompt: a text that will be inserted before the prompt every request on the same context.
 	 * @param Context - The context to use
@@ -45,7 +96,59 @@ public:
 	UFUNCTION(BlueprintCallable, Category="LlamaIntegration")
 	static void SetSuffix(ULlamaContext* Context, FString PromptSuffix);
 
-	/** A list of every context loaded at some point in memory */
+	/**
+	 * Sets how many prompt tokens are evaluated at once when a prompt is prepared on this context.
+	 * The value is clamped to the batch size the context was created with (see plugin settings).
+	 * @param Context - The context to use
+	 * @param BatchSize - The number of tokens per prefill chunk
+	 */
+	UFUNCTION(BlueprintCallable, Category="LlamaIntegration")
+	static void SetBatchSize(ULlamaContext* Context, int BatchSize = 512);
+
+	/** A list of every context loaded in memory, suspended ones included */
 	static TArray<ULlamaContext*> Contexts;
+
+	/** The lock guarding Contexts, the pool and the snapshots of suspended contexts. Never held during a copy, compression, file access or allocation. */
+	static FCriticalSection& GetPoolLock()
+	{
+		return PoolLock;
+	}
+
+private:
+
+	/** A llama context (KV cache and buffers) waiting in the pool for a context of the same model */
+	struct FPooledContext
+	{
+		FLlamaModelWeightsPtr Weights;
+		llama_context* LlamaContext = nullptr;
+	};
+
+	/**
+	 * Returns a llama context for the weights: from the pool, newly created, or taken from the least recently used idle context.
+	 * @param Weights - The weights the llama context must use
+	 * @param Requester - The context that needs it, never suspended to make room for itself
+	 * @return The llama context, null if the pool is exhausted
+	 */
+	static llama_context* TakeLlamaContext(const FLlamaModelWeightsPtr& Weights, const ULlamaContext* Requester);
+
+	/** Puts a llama context back in the pool, or frees it without a pool */
+	static void ReturnLlamaContext(const FLlamaModelWeightsPtr& Weights, llama_context* LlamaContext);
+
+	/** Uncounts a checked out llama context. Requires PoolLock. */
+	static void CheckIn(const FLlamaModelWeightsPtr& Weights);
+
+	/** Number of llama contexts of a model, checked out or pooled. Requires PoolLock. */
+	static int CountLlamaContexts(const FLlamaModelWeightsPtr& Weights);
+
+	/** Moves the least recently used suspended contexts to disk until they fit in the RAM budget. Takes PoolLock, but not while writing. */
+	static void SpillSnapshots();
+
+	static TArray<FPooledContext> PooledContexts;
+
+	/** Number of llama contexts of each model handed out by TakeLlamaContext and not returned or freed yet, or reserved while being created */
+	static TMap<const FLlamaModelWeights*, int32> CheckedOutContexts;
+
+	/** Guards Contexts, PooledContexts, CheckedOutContexts and the snapshots of suspended contexts */
+	static FCriticalSection PoolLock;
 	
 };
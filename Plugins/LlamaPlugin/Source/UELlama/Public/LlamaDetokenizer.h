@@ -0,0 +1,89 @@
+﻿// Copyright 2023 Isara Technologies SAS. All Rights Reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "llama.h"
+
+/** The text piece of every token of a model, computed once when the model is loaded. */
+class FLlamaTokenPieces
+{
+public:
+
+	/** Computes the piece of every token of Model */
+	void Build(const llama_model* Model);
+
+	void Reset()
+	{
+		Bytes.Empty();
+		Offsets.Empty();
+	}
+
+	bool IsEmpty() const
+	{
+		return Offsets.Num() == 0;
+	}
+
+	int Num() const
+	{
+		return FMath::Max(0, Offsets.Num() - 1);
+	}
+
+	/**
+	 * Returns the UTF-8 bytes of a token. The piece may be an incomplete UTF-8 sequence.
+	 * @param Token - The token to look up
+	 * @param OutLen - The number of bytes of the piece
+	 */
+	const ANSICHAR* GetPiece(llama_token Token, int& OutLen) const
+	{
+		if (Token < 0 || Token >= Num())
+		{
+			OutLen = 0;
+			return nullptr;
+		}
+		OutLen = Offsets[Token + 1] - Offsets[Token];
+		return Bytes.GetData() + Offsets[Token];
+	}
+
+private:
+	/** Pieces of every token, one after the other */
+	TArray<ANSICHAR> Bytes;
+
+	/** Start of the piece of each token in Bytes, plus the end of the last one */
+	TArray<int32> Offsets;
+};
+
+/**
+ * Turns a stream of UTF-8 bytes into text.
+ * Bytes of a character split over several tokens are kept until the character is complete.
+ */
+class FLlamaUtf8Decoder
+{
+public:
+
+	/** Drops any pending incomplete character */
+	void Reset()
+	{
+		NPending = 0;
+		NExpected = 0;
+	}
+
+	/** Appends to Out every character completed by the given bytes */
+	void Decode(const ANSICHAR* Data, int Len, FString& Out);
+
+	/** Appends a replacement character to Out if an incomplete character is pending, then resets */
+	void Flush(FString& Out);
+
+	/** Whether some bytes of an incomplete character are waiting for the next token */
+	bool HasPending() const
+	{
+		return NPending > 0;
+	}
+
+private:
+	static void AppendCodepoint(uint32 Codepoint, FString& Out);
+
+	uint8 Pending[4] = {0, 0, 0, 0};
+	int NPending = 0;
+	int NExpected = 0;
+};
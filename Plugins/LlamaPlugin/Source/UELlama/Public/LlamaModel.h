@@ -1,6 +1,8 @@
 ﻿#pragma once
 
 #include "llama.h"
+#include "LlamaDetokenizer.h"
+#include "LlamaPrefixCache.h"
 #include "Kismet/BlueprintFunctionLibrary.h"
 #include "CoreMinimal.h"
 #include "Misc/ScopeRWLock.h"
@@ -11,6 +13,135 @@
 
 #include "LlamaModel.generated.h"
 
+class ULlamaModel;
+
+/** How the weights of a model are brought into memory */
+USTRUCT(BlueprintType)
+struct FLlamaModelLoadOptions
+{
+	GENERATED_USTRUCT_BODY();
+
+	/** Maps the model file instead of reading it: loads faster, and pages are shared with the file cache */
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "LlamaIntegration")
+	bool bUseMmap = true;
+
+	/** Locks the weights in RAM so the system never pages them out */
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "LlamaIntegration")
+	bool bUseMlock = false;
+
+	/**
+	 * After the load, reads the mapped weights ahead and runs a one-token evaluation on a low priority thread,
+	 * so the first answer does not pay for page faults and first-time allocations.
+	 */
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "LlamaIntegration")
+	bool bWarmup = false;
+
+	/**
+	 * A small model with the same vocabulary, loaded with this one, that proposes the next tokens of an answer.
+	 * The model checks a whole proposal in one evaluation (see FLlamaParams::DraftTokens), the answers are the same as without it.
+	 * Contexts of a model with a draft compute the logits of every evaluated token, which takes n_ctx x n_vocab floats per context.
+	 * Empty for no draft model.
+	 */
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "LlamaIntegration")
+	FString DraftModelPath;
+
+	/**
+	 * Lets requests propose tokens found in the conversation itself (see FLlamaParams::bPromptLookup), without a draft model.
+	 * Like with a draft model, contexts compute the logits of every evaluated token, which takes n_ctx x n_vocab floats per context.
+	 */
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "LlamaIntegration")
+	bool bPromptLookup = false;
+
+	/** Whether weights loaded with Other can be reused as if they were loaded with these options */
+	bool IsCompatible(const FLlamaModelLoadOptions& Other) const
+	{
+		return bUseMmap == Other.bUseMmap && bUseMlock == Other.bUseMlock && DraftModelPath == Other.DraftModelPath && bPromptLookup == Other.bPromptLookup;
+	}
+};
+
+/**
+ * The weights of a loaded model. Shared between the ULlamaModel that loaded them and every context created from them:
+ * the weights are freed when the last owner lets go, so contexts keep working while another model replaces them.
+ */
+class FLlamaModelWeights
+{
+public:
+	explicit FLlamaModelWeights(llama_model* InModel);
+	~FLlamaModelWeights();
+
+	FLlamaModelWeights(const FLlamaModelWeights&) = delete;
+	FLlamaModelWeights& operator=(const FLlamaModelWeights&) = delete;
+
+	/**
+	 * Loads the weights of a model file. Blocking, can be called from any thread.
+	 * @param ModelPath - The path of the model stored locally (see ULlamaModel::ResolveModelPath)
+	 * @param Options - How the weights are brought into memory
+	 * @param OnProgress - If set, called on the loading thread with the progress, between 0 and 1
+	 * @return The loaded weights, null if the file could not be loaded
+	 */
+	static TSharedPtr<FLlamaModelWeights, ESPMode::ThreadSafe> Load(const FString& ModelPath, const FLlamaModelLoadOptions& Options = FLlamaModelLoadOptions(), TFunction<void(float)> OnProgress = nullptr);
+
+	/**
+	 * Prefaults the weights and evaluates one token on a throwaway context, on a low priority thread.
+	 * Stops early if the weights are freed meanwhile.
+	 * @param Weights - The weights to warm up
+	 * @param ModelPath - The file they were mapped from, read ahead if the weights are memory mapped
+	 * @param bMapped - Whether the weights are memory mapped
+	 */
+	static void StartWarmup(const TSharedPtr<FLlamaModelWeights, ESPMode::ThreadSafe>& Weights, const FString& ModelPath, bool bMapped);
+
+	llama_model* GetLlamaModel() const
+	{
+		return LlamaModel;
+	}
+
+	/** The text piece of every token of the model */
+	const FLlamaTokenPieces& GetTokenPieces() const
+	{
+		return TokenPieces;
+	}
+
+	/** The states of the persona prefixes already evaluated with this model */
+	FLlamaPrefixStateCache& GetPrefixStates()
+	{
+		return PrefixStates;
+	}
+
+	/** The draft model loaded with this one, null if there is none */
+	const TSharedPtr<FLlamaModelWeights, ESPMode::ThreadSafe>& GetDraftWeights() const
+	{
+		return DraftWeights;
+	}
+
+	/** Whether the contexts of this model keep the logits of every evaluated token, to check several proposed tokens at once */
+	bool ComputesAllLogits() const
+	{
+		return DraftWeights.IsValid() || bPromptLookup;
+	}
+
+	/** Whether requests on this model can propose tokens found in their own history */
+	bool SupportsPromptLookup() const
+	{
+		return bPromptLookup;
+	}
+
+private:
+	llama_model* LlamaModel;
+
+	/** Proposes tokens for the contexts of this model */
+	TSharedPtr<FLlamaModelWeights, ESPMode::ThreadSafe> DraftWeights;
+
+	bool bPromptLookup = false;
+
+	FLlamaPrefixStateCache PrefixStates;
+
+	/** Token pieces computed at load, so decoding a token is a table lookup */
+	FLlamaTokenPieces TokenPieces;
+};
+
+using FLlamaModelWeightsPtr = TSharedPtr<FLlamaModelWeights, ESPMode::ThreadSafe>;
+
+DECLARE_DYNAMIC_DELEGATE_OneParam(FLlamaModelLoadedDelegate, ULlamaModel*, Model);
 
 UCLASS(BlueprintType)
 class ULlamaModel : public UObject
@@ -18,28 +149,75 @@ class ULlamaModel : public UObject
 	GENERATED_BODY()
 
 public:
-	ULlamaModel() : LlamaModel(nullptr)
-	{
-		AddToRoot();
-		Instance = this;
-	}
 
-	virtual ~ULlamaModel() override;
+	/**
+	 * Loads a Llama model into memory. It replaces the current model: contexts created from the previous model
+	 * keep using it until they are freed, then its memory is released.
+	 * @param ModelPath - The path of the model stored locally.
+	 * @param Options - How the weights are brought into memory
+	 * @return The Loaded model
+	 */
+	UFUNCTION(BlueprintCallable, Category = "LlamaIntegration")
+	static ULlamaModel* LoadModel(const FString& ModelPath, FLlamaModelLoadOptions Options = FLlamaModelLoadOptions());
 
 	/**
-	 * Loads a Llama model into memory.
+	 * Loads a Llama model next to the other loaded models, without changing the current model.
+	 * Loading an ID that is already loaded returns the same model.
 	 * @param ModelPath - The path of the model stored locally.
+	 * @param ModelId - The name to find the model with (see FindModel)
+	 * @param Options - How the weights are brought into memory
 	 * @return The Loaded model
 	 */
 	UFUNCTION(BlueprintCallable, Category = "LlamaIntegration")
-	static ULlamaModel* LoadModel(const FString& ModelPath);
+	static ULlamaModel* LoadModelWithId(const FString& ModelPath, const FString& ModelId, FLlamaModelLoadOptions Options = FLlamaModelLoadOptions());
+
+	/**
+	 * Finds a model file on disk. A path that does not exist as given is looked for in the model folder of the plugin settings,
+	 * where packaged games find the models staged beside them.
+	 * @param ModelPath - An absolute path, a path relative to the project or to the model folder, or a file name
+	 * @return The full path of the file, or ModelPath if it was not found
+	 */
+	UFUNCTION(BlueprintCallable, BlueprintPure, Category = "LlamaIntegration")
+	static FString ResolveModelPath(const FString& ModelPath);
+
+	/**
+	 * Returns the model loaded with LoadModelWithId under this ID (or with LoadModel under this path), null if there is none.
+	 */
+	UFUNCTION(BlueprintCallable, BlueprintPure, Category = "LlamaIntegration")
+	static ULlamaModel* FindModel(const FString& ModelId);
+
+	/**
+	 * Loads a Llama model on a background thread, then makes it the current model.
+	 * Requests running on contexts of the previous model are not interrupted.
+	 * @param ModelPath - The path of the model stored locally.
+	 * @param OnLoaded - Called on the game thread with the new model, or with null if it could not be loaded
+	 * See ULlamaModelLoadAsyncActionNode for progress and cancellation.
+	 */
+	UFUNCTION(BlueprintCallable, Category = "LlamaIntegration")
+	static void LoadModelInBackground(const FString& ModelPath, const FLlamaModelLoadedDelegate& OnLoaded);
 
 	/**
-	 * Unloads a Llama model from memory.
+	 * Unloads the current model from memory, with the contexts created from it.
 	 */
 	UFUNCTION(BlueprintCallable, Category = "LlamaIntegration")
 	static void FreeModel();
 
+	/**
+	 * Unloads this model from memory, with the contexts created from it. It is loaded again in the background if a new context needs it.
+	 */
+	UFUNCTION(BlueprintCallable, Category = "LlamaIntegration")
+	void Unload();
+
+	/**
+	 * Returns whether the weights of this model are in memory. An evicted model is loaded back in the background
+	 * when a context is requested from it: the request fails, and can be made again once this returns true.
+	 */
+	UFUNCTION(BlueprintCallable, BlueprintPure, Category = "LlamaIntegration")
+	bool IsLoaded() const
+	{
+		return Weights.IsValid();
+	}
+
 	/**
 	 * Returns the model called on the last LoadModel call.
 	 */
@@ -51,29 +229,77 @@ public:
 
 	llama_model* GetLlamaModel() const
 	{
-		return LlamaModel;
+		return Weights.IsValid() ? Weights->GetLlamaModel() : nullptr;
 	}
 
-	static FRWLock& GetLock()
+	/** The weights of this model, null once it was unloaded or replaced */
+	const FLlamaModelWeightsPtr& GetWeights() const
 	{
-		return WriteLock;
+		return Weights;
 	}
 
-	UFUNCTION()
-	void OnEndPIE(bool bIsSimulating)
+	const FString& GetModelId() const
+	{
+		return ModelId;
+	}
+
+	const FString& GetModelPath() const
+	{
+		return ModelPath;
+	}
+
+	const FLlamaModelLoadOptions& GetLoadOptions() const
 	{
-		FreeModel();
+		return LoadOptions;
 	}
 
+	/**
+	 * Adds weights loaded on another thread to the loaded models. Game thread only.
+	 * @param ModelPath - The path the weights were loaded from
+	 * @param ModelId - The name to find the model with, the path if empty
+	 * @param Options - How the weights were loaded, used again if the model is evicted then reloaded
+	 * @param LoadedWeights - The weights
+	 * @param bMakeCurrent - Whether the model replaces the current model (see LoadModel)
+	 * @return The model holding the weights
+	 */
+	static ULlamaModel* AddLoadedModel(const FString& ModelPath, const FString& ModelId, const FLlamaModelLoadOptions& Options, FLlamaModelWeightsPtr LoadedWeights, bool bMakeCurrent);
+
+	UFUNCTION()
+	void OnEndPIE(bool bIsSimulating);
+
 private:
-	//Only one model is used during execution
+	friend class FLlamaModelRegistry;
+
+	/** Makes a model the current one. The previous current model is removed from the registry. */
+	static ULlamaModel* SetInstance(ULlamaModel* LlamaModel);
+
+	/**
+	 * Frees the contexts created from this model.
+	 * @param bReturnToPool - Whether contexts go back to the context pool (if enabled) instead of being destroyed
+	 */
+	void FreeContexts(bool bReturnToPool);
+
+	//The model used by default, loaded by the last LoadModel call
 	static ULlamaModel* Instance;
 
-	static FRWLock WriteLock;
-	llama_model* LlamaModel;
+	/** This model's reference on the weights. Contexts created from it hold their own. */
+	FLlamaModelWeightsPtr Weights;
+
+	/** The key of the model in the registry */
+	FString ModelId;
+
+	FString ModelPath;
+
+	FLlamaModelLoadOptions LoadOptions;
+
+	/** Memory taken by the weights once loaded, in bytes */
+	int64 SizeBytes = 0;
+
+	/** When a context was last created from or released this model, to evict the least recently used first */
+	double LastUsedTime = 0.0;
 
-	//Check if llama memory has already been destroyed
-	inline static bool isUnloaded;
+	/** Whether the weights are being loaded back on a background thread after an eviction */
+	bool bReloading = false;
 
 #if WITH_EDITOR
 	FDelegateHandle EndPIEdelegate = FEditorDelegates::EndPIE.AddUObject(this, &ULlamaModel::OnEndPIE);
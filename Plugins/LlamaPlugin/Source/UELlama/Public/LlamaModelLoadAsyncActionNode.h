@@ -0,0 +1,57 @@
+// Copyright 2023 Isara Technologies SAS. All Rights Reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "LlamaCancellationToken.h"
+#include "LlamaModel.h"
+#include "Kismet/BlueprintAsyncActionBase.h"
+
+#include "LlamaModelLoadAsyncActionNode.generated.h"
+
+DECLARE_DYNAMIC_MULTICAST_DELEGATE_OneParam(FLlamaModelLoadProgress, float, Progress);
+DECLARE_DYNAMIC_MULTICAST_DELEGATE_OneParam(FLlamaModelLoadOutput, ULlamaModel*, Model);
+
+/** A Class that implements the load model node in an async way: the file is read on a background thread. */
+UCLASS()
+class ULlamaModelLoadAsyncActionNode : public UBlueprintAsyncActionBase
+{
+	GENERATED_BODY()
+
+public:
+
+	/** Called on the game thread while the model loads, with the progress between 0 and 1 */
+	UPROPERTY(BlueprintAssignable)
+	FLlamaModelLoadProgress Progress;
+
+	UPROPERTY(BlueprintAssignable)
+	FLlamaModelLoadOutput Loaded;
+
+	/** Called if the file could not be loaded or the load was cancelled */
+	UPROPERTY(BlueprintAssignable)
+	FLlamaModelLoadOutput Failed;
+
+	/**
+	 * Loads a Llama model on a background thread.
+	 * @param ModelPath - The path of the model stored locally
+	 * @param ModelId - The name to find the model with (see FindModel), the path if empty
+	 * @param bMakeCurrent - Whether the model replaces the current model, like LoadModel does
+	 * @param Options - How the weights are brought into memory
+	 */
+	UFUNCTION(BlueprintCallable, meta = (BlueprintInternalUseOnly = "true"), category = "LlamaIntegration")
+	static ULlamaModelLoadAsyncActionNode* LoadModelAsync(const FString& ModelPath, const FString& ModelId, bool bMakeCurrent = true, FLlamaModelLoadOptions Options = FLlamaModelLoadOptions());
+
+	/** Cancels the load. The model is never added, the memory it took is released once the file is read. */
+	UFUNCTION(BlueprintCallable, Category = "LlamaIntegration")
+	void Cancel();
+
+	virtual void Activate() override;
+
+private:
+	FString ModelPath;
+	FString ModelId;
+	bool bMakeCurrent;
+	FLlamaModelLoadOptions Options;
+
+	FLlamaCancellationPtr Cancellation = MakeShared<FLlamaCancellation, ESPMode::ThreadSafe>();
+};
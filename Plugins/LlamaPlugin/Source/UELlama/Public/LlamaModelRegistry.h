@@ -0,0 +1,64 @@
+﻿// Copyright 2023 Isara Technologies SAS. All Rights Reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "LlamaModel.h"
+
+/**
+ * Every model loaded by the plugin, keyed by ID (the model path unless an ID is given).
+ * Loaded models share the memory budget set in the plugin settings: when a model needs room, the models no context
+ * uses are unloaded, least recently used first. An unloaded model keeps its entry and is loaded again in the background
+ * when a context needs it.
+ * Game thread only.
+ */
+class FLlamaModelRegistry
+{
+public:
+
+	/**
+	 * Returns the model registered under ModelId, loading the file if needed.
+	 * @param ModelId - The key of the model
+	 * @param ModelPath - The path of the model stored locally
+	 * @param Options - How the weights are brought into memory
+	 * @return The model, its weights are null if the file could not be loaded
+	 */
+	static ULlamaModel* FindOrLoad(const FString& ModelId, const FString& ModelPath, const FLlamaModelLoadOptions& Options = FLlamaModelLoadOptions());
+
+	/**
+	 * Registers weights loaded elsewhere (e.g. on a background thread) under ModelId, replacing the previous ones.
+	 * @return The model holding the weights
+	 */
+	static ULlamaModel* Register(const FString& ModelId, const FString& ModelPath, const FLlamaModelLoadOptions& Options, FLlamaModelWeightsPtr Weights);
+
+	/** Returns the model registered under ModelId, null if there is none */
+	static ULlamaModel* Find(const FString& ModelId);
+
+	/**
+	 * Returns the weights of a model to create a context from. Marks the model as used.
+	 * Never loads on the caller's thread: if the weights were evicted, they are loaded back in the background and null is returned.
+	 */
+	static FLlamaModelWeightsPtr Acquire(ULlamaModel* Model);
+
+	/** Marks a model as used now */
+	static void Touch(ULlamaModel* Model);
+
+	/** Removes a model from the registry and drops its weights. Contexts using them keep them alive. */
+	static void Remove(ULlamaModel* Model);
+
+	/** Unloads idle models, least recently used first, until Bytes more fit in the budget */
+	static void MakeRoom(int64 Bytes, const ULlamaModel* Keep = nullptr);
+
+	/** Memory used by the loaded models, in bytes */
+	static int64 GetLoadedBytes();
+
+	/** Size of a model file, which is what its weights take in memory */
+	static int64 GetModelFileSize(const FString& ModelPath);
+
+private:
+
+	/** Loads the weights of an evicted model on a background thread, and gives them back to the model on the game thread */
+	static void StartReload(ULlamaModel* Model);
+
+	static TMap<FString, ULlamaModel*> Models;
+};
@@ -0,0 +1,92 @@
+﻿// Copyright 2023 Isara Technologies SAS. All Rights Reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "Misc/ScopeLock.h"
+#include "llama.h"
+
+/**
+ * Context states captured right after a persona prefix was evaluated, keyed by a hash of the prefix tokens.
+ * A new context with the same prefix copies the state in (llama_set_state_data) instead of evaluating the prefix again.
+ * Owned by the model weights: a state can only be loaded into a context of the same model. Thread safe.
+ */
+class FLlamaPrefixStateCache
+{
+public:
+	using FStatePtr = TSharedPtr<const TArray64<uint8>, ESPMode::ThreadSafe>;
+
+	/** The number of prefixes kept, the least recently used is dropped first */
+	static constexpr int32 MaxEntries = 8;
+
+	/**
+	 * Returns the state captured after evaluating Tokens on a context of NCtx tokens, null if there is none.
+	 */
+	FStatePtr Find(const TArray<llama_token>& Tokens, int32 NCtx)
+	{
+		const uint32 Hash = HashTokens(Tokens, NCtx);
+
+		FScopeLock ScopeLock(&Lock);
+		for (FEntry& Entry : Entries)
+		{
+			if (Entry.Hash == Hash && Entry.NCtx == NCtx && Entry.Tokens == Tokens)
+			{
+				Entry.LastUse = ++UseCounter;
+				return Entry.State;
+			}
+		}
+		return nullptr;
+	}
+
+	/** Keeps the state captured after evaluating Tokens on a context of NCtx tokens */
+	void Add(const TArray<llama_token>& Tokens, int32 NCtx, TArray64<uint8>&& State)
+	{
+		FEntry NewEntry;
+		NewEntry.Hash = HashTokens(Tokens, NCtx);
+		NewEntry.NCtx = NCtx;
+		NewEntry.Tokens = Tokens;
+		NewEntry.State = MakeShared<const TArray64<uint8>, ESPMode::ThreadSafe>(MoveTemp(State));
+
+		FScopeLock ScopeLock(&Lock);
+		NewEntry.LastUse = ++UseCounter;
+
+		if (Entries.Num() >= MaxEntries)
+		{
+			int32 Oldest = 0;
+			for (int32 i = 1; i < Entries.Num(); i++)
+			{
+				if (Entries[i].LastUse < Entries[Oldest].LastUse)
+				{
+					Oldest = i;
+				}
+			}
+			Entries.RemoveAtSwap(Oldest);
+		}
+		Entries.Add(MoveTemp(NewEntry));
+	}
+
+	void Reset()
+	{
+		FScopeLock ScopeLock(&Lock);
+		Entries.Reset();
+	}
+
+	static uint32 HashTokens(const TArray<llama_token>& Tokens, int32 NCtx)
+	{
+		return FCrc::MemCrc32(Tokens.GetData(), Tokens.Num() * sizeof(llama_token), static_cast<uint32>(NCtx));
+	}
+
+private:
+	struct FEntry
+	{
+		uint32 Hash = 0;
+		int32 NCtx = 0;
+		TArray<llama_token> Tokens;
+		FStatePtr State;
+		uint64 LastUse = 0;
+	};
+
+	FCriticalSection Lock;
+	TArray<FEntry> Entries;
+	uint64 UseCounter = 0;
+};
@@ -3,11 +3,22 @@
 #pragma once
 
 #include "LlamaContext.h"
+#include "LlamaSampler.h"
 #include "Misc/ScopeRWLock.h"
 
 #include "LlamaRunner.generated.h"
 
 DECLARE_DYNAMIC_DELEGATE_OneParam(FLlamaRequestCallDelegate, FString, Answer);
+DECLARE_DYNAMIC_DELEGATE_ThreeParams(FLlamaStreamDelegate, const FString&, Delta, const TArray<int32>&, Tokens, int32, Offset);
+
+/** How urgent a request is. Higher priorities run first and pause lower priority requests between two tokens. */
+UENUM(BlueprintType)
+enum class ELlamaPriority : uint8
+{
+	Background,
+	Normal,
+	PlayerFacing
+};
 
 USTRUCT(BlueprintType)
 struct FLlamaParams
@@ -32,6 +43,7 @@ struct FLlamaParams
 	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "LlamaIntegration Advanced Params")
 	float TypicalP = 1.00f;
 
+	/** Number of past tokens the repeat, frequency and presence penalties look at (-1 for the whole context) */
 	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "LlamaIntegration Advanced Params")
 	int32 RepeatLastN = 64;
 	
@@ -55,6 +67,26 @@ struct FLlamaParams
 
 	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "LlamaIntegration Advanced Params")
 	bool PenalizeNl = true;
+
+	/**
+	 * Maximum number of tokens proposed at each step of the answer, checked together in one evaluation (0 to disable).
+	 * Tokens are proposed by the draft model (see FLlamaModelLoadOptions) or found by prompt lookup. Not used with mirostat.
+	 * At most the batch size of the plugin settings minus one.
+	 */
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "LlamaIntegration Advanced Params", meta = (ClampMin = "0"))
+	int32 DraftTokens = 4;
+
+	/**
+	 * Proposes the tokens that followed the last generated tokens where they already appear in the conversation (prompt lookup),
+	 * e.g. names and phrases the player used. Needs no draft model, but the model must be loaded with FLlamaModelLoadOptions::bPromptLookup.
+	 * With a draft model too, the draft only proposes when the conversation has nothing to offer.
+	 */
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "LlamaIntegration Advanced Params")
+	bool bPromptLookup = false;
+
+	/** Scheduling priority of the request when it runs through an async node */
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "LlamaIntegration Advanced Params")
+	ELlamaPriority Priority = ELlamaPriority::Normal;
 };
 
 
@@ -71,10 +103,11 @@ public:
 	 * @param Prompt - The prompt submitted by the user
 	 * @param AnswerLength - The specified character limit for the response (the response may be truncated mid-sentence)
 	 * @param Params - Advanced parameters to customize responses quality 
+	 * @param CancellationToken - Optional token to stop the generation early
 	 * @return The AI's response to the user's prompt
 	 */
 	UFUNCTION(BlueprintCallable, Category="LlamaIntegration")
-	static FString GetAIAnswer(ULlamaContext* Context, FString Prompt, int AnswerLength = 50, FLlamaParams Params = FLlamaParams());
+	static FString GetAIAnswer(ULlamaContext* Context, FString Prompt, int AnswerLength = 50, FLlamaParams Params = FLlamaParams(), ULlamaCancellationToken* CancellationToken = nullptr);
 
 	/**
 	 * Uses a Llama model to interpret a user request and returns the result of the request. 
@@ -83,10 +116,80 @@ public:
 	 * @param Prompt - The prompt submitted by the user
 	 * @param Callback - The Event that will be called when a new word is generated
 	 * @param AnswerLength - The specified character limit for the response (the response may be truncated mid-sentence)
+	 * @param CancellationToken - Optional token to stop the generation early
+	 * @return The AI's response to the user's prompt.
+	 */
+	UFUNCTION(BlueprintCallable, Category="LlamaIntegration")
+	static FString GetAIAnswerWithCallback(ULlamaContext* Context, FString Prompt, const FLlamaRequestCallDelegate& Callback, int AnswerLength = 50, FLlamaParams Params = FLlamaParams(), ULlamaCancellationToken* CancellationToken = nullptr);
+
+	/**
+	 * Uses a Llama model to interpret a user request and returns the result of the request.
+	 * Streams the response while it is still generating: the callback only receives the text added since its last call.
+	 * @param Context - The context to use
+	 * @param Prompt - The prompt submitted by the user
+	 * @param Callback - The Event called with the new text, the tokens it comes from and its position in the full answer
+	 * @param AnswerLength - The specified character limit for the response (the response may be truncated mid-sentence)
+	 * @param Params - Advanced parameters to customize responses quality 
+	 * @param CancellationToken - Optional token to stop the generation early
 	 * @return The AI's response to the user's prompt.
 	 */
 	UFUNCTION(BlueprintCallable, Category="LlamaIntegration")
-	static FString GetAIAnswerWithCallback(ULlamaContext* Context, FString Prompt, const FLlamaRequestCallDelegate& Callback, int AnswerLength = 50, FLlamaParams Params = FLlamaParams());
+	static FString GetAIAnswerWithStream(ULlamaContext* Context, FString Prompt, const FLlamaStreamDelegate& Callback, int AnswerLength = 50, FLlamaParams Params = FLlamaParams(), ULlamaCancellationToken* CancellationToken = nullptr);
+
+	/** C++ versions of the functions above, taking the cancellation flag itself so they can run on any thread */
+	static FString GetAIAnswerCancellable(ULlamaContext* Context, FString Prompt, int AnswerLength, const FLlamaParams& Params, const FLlamaCancellationPtr& Cancellation);
+	static FString GetAIAnswerWithCallbackCancellable(ULlamaContext* Context, FString Prompt, const FLlamaRequestCallDelegate& Callback, int AnswerLength, const FLlamaParams& Params, const FLlamaCancellationPtr& Cancellation);
+	static FString GetAIAnswerWithStreamCancellable(ULlamaContext* Context, FString Prompt, const FLlamaStreamDelegate& Callback, int AnswerLength, const FLlamaParams& Params, const FLlamaCancellationPtr& Cancellation);
+
+	/**
+	 * Cuts the last answer of a context where the player interrupted it, so the model only remembers what was actually said.
+	 * The unspoken end of the answer leaves the history without any evaluation, then the marker is evaluated after the spoken part.
+	 * Cancel the generation first if it is still running: this waits for it to end.
+	 * @param Context - The context to use
+	 * @param SpokenCharacters - The number of characters of the answer the speech pipeline actually spoke
+	 * @param Marker - Text added after the spoken part to tell the model it was interrupted, nothing if empty
+	 * @return Whether the answer was cut and the marker added
+	 */
+	UFUNCTION(BlueprintCallable, Category="LlamaIntegration")
+	static bool InterruptAnswer(ULlamaContext* Context, int32 SpokenCharacters, FString Marker = TEXT("..."));
+
+	/**
+	 * Same as InterruptAnswer, from a number of spoken tokens (e.g. counted from the tokens given to the stream callback)
+	 * @param Context - The context to use
+	 * @param SpokenTokens - The number of tokens of the answer the speech pipeline actually spoke
+	 * @param Marker - Text added after the spoken part to tell the model it was interrupted, nothing if empty
+	 * @return Whether the answer was cut and the marker added
+	 */
+	UFUNCTION(BlueprintCallable, Category="LlamaIntegration")
+	static bool InterruptAnswerAtToken(ULlamaContext* Context, int32 SpokenTokens, FString Marker = TEXT("..."));
+
+	/**
+	 * Prefills the prompt of the next turn while the player is still talking, from the partial transcript of the speech recognizer.
+	 * Call it each time the transcript changes, then call a GetAIAnswer function with the final transcript as usual:
+	 * only the tokens that differ from what was already prefilled are evaluated then.
+	 * When the recognizer revises earlier words, only the prefilled tokens after the first difference are rolled back.
+	 * The update runs on the inference threads and returns immediately; an update superseded by a newer one is skipped.
+	 * @param Context - The context to use
+	 * @param PartialPrompt - The transcript so far
+	 */
+	UFUNCTION(BlueprintCallable, Category="LlamaIntegration")
+	static void UpdatePartialPrompt(ULlamaContext* Context, FString PartialPrompt);
+
+	/**
+	 * Forgets the partial prompt prefilled by UpdatePartialPrompt, e.g. when the player stopped talking without a final transcript.
+	 * Waits for the running evaluation on the context, if any.
+	 * @param Context - The context to use
+	 */
+	UFUNCTION(BlueprintCallable, Category="LlamaIntegration")
+	static void DiscardPartialPrompt(ULlamaContext* Context);
+
+	/**
+	 * The work of UpdatePartialPrompt, run on the calling thread.
+	 * @param Context - The context to use
+	 * @param PartialPrompt - The transcript so far
+	 * @return Whether the partial prompt was prefilled
+	 */
+	static bool PrefillPartialPrompt(ULlamaContext* Context, const FString& PartialPrompt);
 
 	/**
 	 * Tokenizes and interprets the user's input prompt, preparing the answer for evaluation.
@@ -105,6 +208,39 @@ public:
 	 * @return The translation of the token in a human-readable language.
 	 */
 	static FString PredictNextToken(ULlamaContext* Context, bool& EndReached, FLlamaParams Params);
+
+	/**
+	 * Evaluates a token and return the translation of the token in a human-readable language
+	 * @param Context - The context to use
+	 * @param EndReached - Whether Llama has finished to answer or not
+	 * @param Chain - The sampling stages built from the request parameters
+	 * @param OutToken - If not null, receives the sampled token
+	 * @return The translation of the token in a human-readable language.
+	 */
+	static FString PredictNextToken(ULlamaContext* Context, bool& EndReached, const FLlamaSamplerChain& Chain, llama_token* OutToken = nullptr);
+
+private:
+
+	/**
+	 * Prepares the prompt then generates the answer token by token. Shared by every GetAIAnswer variant.
+	 * @param Context - The context to use
+	 * @param Prompt - The prompt submitted by the user
+	 * @param AnswerLength - The maximum number of tokens to generate
+	 * @param Params - Advanced parameters to customize responses quality
+	 * @param Cancellation - Checked between two prefill chunks and between two tokens, may be null
+	 * @param OnToken - Called after each token with the answer so far, the text of the token and the token itself
+	 * @return The AI's response to the user's prompt.
+	 */
+	static FString GenerateAnswer(ULlamaContext* Context, FString Prompt, int AnswerLength, const FLlamaParams& Params, const FLlamaCancellationPtr& Cancellation, TFunctionRef<void(const FString&, const FString&, llama_token)> OnToken);
+
+	/**
+	 * Shared by the InterruptAnswer variants.
+	 * @param Context - The context to use
+	 * @param CountSpokenTokens - Returns how many tokens of the last answer were spoken, called with the write lock held
+	 * @param Marker - Text added after the spoken part, nothing if empty
+	 * @return Whether the answer was cut and the marker added
+	 */
+	static bool CutAnswer(ULlamaContext* Context, TFunctionRef<int(ULlamaContext*)> CountSpokenTokens, const FString& Marker);
 	
 };
 
@@ -6,7 +6,6 @@
 #include "LlamaRunner.h"
 #include "Kismet/BlueprintAsyncActionBase.h"
 #include "Misc/ScopeRWLock.h"
-#include "Async/AsyncWork.h"
 
 #include "LlamaRunnerAsyncActionNode.generated.h"
 
@@ -24,11 +23,17 @@ public:
 	FAsyncTaskOutput FinishedWork;
 
 	UFUNCTION(BlueprintCallable, meta = (BlueprintInternalUseOnly = "true"), category = "LlamaIntegration")
-	static ULlamaRunnerAsyncActionNode* GetAIAnswerAsync(ULlamaContext* Context, FString Prompt, int AnswerLength = 50, FLlamaParams Params = FLlamaParams());
+	static ULlamaRunnerAsyncActionNode* GetAIAnswerAsync(ULlamaContext* Context, FString Prompt, int AnswerLength = 50, FLlamaParams Params = FLlamaParams(), ULlamaCancellationToken* CancellationToken = nullptr);
 
-	virtual void Activate() override;
+	/** Cancels the request of this node. The generation stops before its next token. */
+	UFUNCTION(BlueprintCallable, Category = "LlamaIntegration")
+	void Cancel();
+
+	/** The token cancelling the request: the one given to the node, or a new one */
+	UPROPERTY(BlueprintReadOnly, Category = "LlamaIntegration")
+	ULlamaCancellationToken* CancellationToken;
 
-	friend class BP_GetAIAnswerAsyncTask;
+	virtual void Activate() override;
 
 private:
 	ULlamaContext *Context;
@@ -36,24 +41,3 @@ private:
 	int AnswerLength;
 	FLlamaParams Params;
 };
-
-//===================================================================================
-/** A Class that implements an Async Task. Allows the user to execute some work on another thread. */
-class BP_GetAIAnswerAsyncTask : public FNonAbandonableTask
-{
-public:
-	BP_GetAIAnswerAsyncTask(ULlamaRunnerAsyncActionNode* BP_TaskInstance);
-
-	~BP_GetAIAnswerAsyncTask();
-
-	FORCEINLINE TStatId GetStatId() const
-	{
-		RETURN_QUICK_DECLARE_CYCLE_STAT(ExampleAutoDeleteAsyncTask, STATGROUP_ThreadPoolAsyncTasks);
-	}
-
-	TWeakObjectPtr<ULlamaRunnerAsyncActionNode> CallingObject;
-
-	void DoWork();
-
-	FString Answer;
-};
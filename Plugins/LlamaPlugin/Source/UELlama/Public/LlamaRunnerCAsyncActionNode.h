@@ -6,7 +6,6 @@
 #include "LlamaRunner.h"
 #include "Kismet/BlueprintAsyncActionBase.h"
 #include "Misc/ScopeRWLock.h"
-#include "Async/AsyncWork.h"
 
 #include "LlamaRunnerCAsyncActionNode.generated.h"
 
@@ -24,38 +23,27 @@ public:
 	FAsyncCTaskOutput FinishedWork;
 
 	UFUNCTION(BlueprintCallable, meta = (BlueprintInternalUseOnly = "true"), category = "LlamaIntegration")
-	static ULlamaRunnerCAsyncActionNode* GetAIAnswerWithCallbackAsync(ULlamaContext* Context, FString Prompt, const FLlamaRequestCallDelegate Callback, int AnswerLength = 50, FLlamaParams Params = FLlamaParams());
+	static ULlamaRunnerCAsyncActionNode* GetAIAnswerWithCallbackAsync(ULlamaContext* Context, FString Prompt, const FLlamaRequestCallDelegate Callback, int AnswerLength = 50, FLlamaParams Params = FLlamaParams(), ULlamaCancellationToken* CancellationToken = nullptr);
 
-	virtual void Activate() override;
+	/** Same as GetAIAnswerWithCallbackAsync, but the callback only receives the text added since its last call */
+	UFUNCTION(BlueprintCallable, meta = (BlueprintInternalUseOnly = "true"), category = "LlamaIntegration")
+	static ULlamaRunnerCAsyncActionNode* GetAIAnswerWithStreamAsync(ULlamaContext* Context, FString Prompt, const FLlamaStreamDelegate StreamCallback, int AnswerLength = 50, FLlamaParams Params = FLlamaParams(), ULlamaCancellationToken* CancellationToken = nullptr);
+
+	/** Cancels the request of this node. The generation stops before its next token. */
+	UFUNCTION(BlueprintCallable, Category = "LlamaIntegration")
+	void Cancel();
+
+	/** The token cancelling the request: the one given to the node, or a new one */
+	UPROPERTY(BlueprintReadOnly, Category = "LlamaIntegration")
+	ULlamaCancellationToken* CancellationToken;
 
-	friend class BP_GetAIAnswerCAsyncTask;
+	virtual void Activate() override;
 
 private:
 	ULlamaContext *Context;
 	FString Prompt;
 	FLlamaRequestCallDelegate Callback;
+	FLlamaStreamDelegate StreamCallback;
 	int AnswerLength;
 	FLlamaParams Params;
 };
-
-//===================================================================================
-
-/** A Class that implements an Async Task. Allows the user to execute some work on another thread. */
-class BP_GetAIAnswerCAsyncTask : public FNonAbandonableTask
-{
-public:
-	BP_GetAIAnswerCAsyncTask(ULlamaRunnerCAsyncActionNode* BP_TaskInstance);
-
-	~BP_GetAIAnswerCAsyncTask();
-
-	FORCEINLINE TStatId GetStatId() const
-	{
-		RETURN_QUICK_DECLARE_CYCLE_STAT(ExampleAutoDeleteAsyncTask, STATGROUP_ThreadPoolAsyncTasks);
-	}
-
-	TWeakObjectPtr<ULlamaRunnerCAsyncActionNode> CallingObject;
-
-	void DoWork();
-
-	FString Answer;
-};
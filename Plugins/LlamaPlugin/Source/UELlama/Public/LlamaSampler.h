@@ -0,0 +1,110 @@
+﻿// Copyright 2023 Isara Technologies SAS. All Rights Reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "llama.h"
+#include "LlamaSamplerState.h"
+
+struct FLlamaParams;
+
+/**
+ * The sampling stages of a request, computed once from FLlamaParams.
+ * Stages that would not change the distribution (TfsZ = 1, TypicalP = 1, TopP = 1, Temp = 1, penalties of 1 or 0...) are left out.
+ */
+struct FLlamaSamplerChain
+{
+	enum class EMode : uint8
+	{
+		Greedy,
+		Mirostat,
+		MirostatV2,
+		Standard
+	};
+
+	EMode Mode = EMode::Standard;
+
+	/** Number of past tokens looked at by the penalties, -1 for every remembered token */
+	int RepeatLastN = 64;
+	bool bRepeatPenalty = false;
+	bool bFrequencyPresencePenalty = false;
+	bool bPenalizeNl = true;
+
+	float RepeatPenalty = 1.f;
+	float AlphaFrequency = 0.f;
+	float AlphaPresence = 0.f;
+
+	/** 0 when the top-k stage is skipped */
+	int TopK = 0;
+	bool bTailFree = false;
+	bool bTypical = false;
+	bool bTopP = false;
+	bool bTemperature = false;
+
+	float TfsZ = 1.f;
+	float TypicalP = 1.f;
+	float TopP = 1.f;
+	float Temp = 1.f;
+
+	float MirostatTau = 5.f;
+	float MirostatEta = 0.1f;
+	int MirostatM = 100;
+
+	/** Builds the chain matching Params */
+	static FLlamaSamplerChain FromParams(const FLlamaParams& Params);
+};
+
+/** Samples tokens from the logits of the last evaluation without allocating per token. */
+class FLlamaSampler
+{
+public:
+
+	/**
+	 * Samples the next token from some logits of a context.
+	 * The penalties are applied on the logits in place.
+	 * @param Ctx - The llama context that was just evaluated
+	 * @param Logits - The logits of the token to sample after (see ULlamaContext::GetLastLogits)
+	 * @param State - The sampler state of the context (history, mirostat state and candidate buffer)
+	 * @param Chain - The sampling stages to run
+	 * @return The sampled token
+	 */
+	static llama_token Sample(llama_context* Ctx, float* Logits, FLlamaSamplerState& State, const FLlamaSamplerChain& Chain);
+
+	/**
+	 * Runs the stages of a greedy or standard chain and leaves the distribution Sample would draw from in Candidates,
+	 * sorted by decreasing probability. A greedy chain gives its best token with a probability of 1.
+	 * The penalties are applied on the logits in place. Candidates points to the candidate buffer of State.
+	 * @param Ctx - The llama context the logits come from
+	 * @param Logits - The logits of the token to sample after
+	 * @param State - The sampler state of the context
+	 * @param Chain - The sampling stages to run, not mirostat
+	 * @param Candidates - Receives the distribution
+	 */
+	static void ComputeDistribution(llama_context* Ctx, float* Logits, FLlamaSamplerState& State, const FLlamaSamplerChain& Chain, llama_token_data_array& Candidates);
+
+	/**
+	 * Draws a token from candidates holding probabilities (not necessarily normalized)
+	 * @param State - The sampler state of the context, whose random generator makes the draw
+	 */
+	static llama_token SampleFromProbabilities(FLlamaSamplerState& State, const llama_token_data* Candidates, int NCandidates);
+
+	/** Fills Out with one candidate per logit. Out must hold NVocab elements. */
+	static void FillCandidates(const float* Logits, int NVocab, llama_token_data* Out);
+
+private:
+
+	/** Applies the repeat, frequency and presence penalties directly on the logits of the remembered tokens */
+	static void ApplyPenalties(float* Logits, FLlamaSamplerState& State, const FLlamaSamplerChain& Chain);
+
+	/** Applies the penalties of the chain, if any, leaving the newline logit alone unless the chain penalizes it */
+	static void PenalizeLogits(llama_context* Ctx, float* Logits, FLlamaSamplerState& State, const FLlamaSamplerChain& Chain);
+
+	/** Index of the best logit */
+	static llama_token FindBestToken(const float* Logits, int NVocab);
+
+	/** Runs the stages of a standard chain on the candidates */
+	static void ApplyStandardStages(llama_context* Ctx, llama_token_data_array& Candidates, const FLlamaSamplerChain& Chain);
+
+	/** Keeps the K best candidates, sorted by decreasing logit */
+	static void SelectTopK(llama_token_data_array& Candidates, int K);
+};
@@ -0,0 +1,204 @@
+﻿// Copyright 2023 Isara Technologies SAS. All Rights Reserved.
+
+#pragma once
+
+#include <random>
+
+#include "CoreMinimal.h"
+#include "llama.h"
+
+/**
+ * Sampling state that must survive from one token to the next on a given context:
+ * the last generated/evaluated tokens used by the repeat, frequency and presence penalties, and the mirostat state.
+ */
+class FLlamaSamplerState
+{
+public:
+
+	/** Sets how many past tokens are remembered for the penalties and clears the state */
+	void SetCapacity(int InCapacity)
+	{
+		Capacity = FMath::Max(1, InCapacity);
+
+		// Every token is written twice, Capacity apart, so the last N tokens are always contiguous
+		LastTokens.SetNumZeroed(2 * Capacity);
+		Added = 0;
+		Reset();
+	}
+
+	int GetCapacity() const
+	{
+		return Capacity;
+	}
+
+	/** Forgets the token history and the mirostat state */
+	void Reset()
+	{
+		Next = 0;
+		Count = 0;
+		bMirostatInitialized[0] = bMirostatInitialized[1] = false;
+	}
+
+	void Add(llama_token Token)
+	{
+		if (Capacity == 0)
+		{
+			SetCapacity(1);
+		}
+
+		LastTokens[Next] = Token;
+		LastTokens[Next + Capacity] = Token;
+		Next = (Next + 1) % Capacity;
+		Count = FMath::Min(Count + 1, Capacity);
+		Added++;
+	}
+
+	void Append(const llama_token* Tokens, int NTokens)
+	{
+		for (int i = 0; i < NTokens; i++)
+		{
+			Add(Tokens[i]);
+		}
+	}
+
+	/** Forgets the N most recently added tokens, e.g. the unspoken end of an interrupted answer */
+	void RemoveLast(int N)
+	{
+		N = FMath::Clamp(N, 0, Count);
+		Next = (Next - N + Capacity) % FMath::Max(1, Capacity);
+		Count -= N;
+	}
+
+	/**
+	 * Returns the N most recent tokens, oldest first, as a contiguous array.
+	 * @param N - The number of tokens wanted, negative for every remembered token. Updated with the real count.
+	 */
+	const llama_token* GetLastTokens(int& N) const
+	{
+		N = N < 0 ? Count : FMath::Min(N, Count);
+		if (N == 0)
+		{
+			return nullptr;
+		}
+		return LastTokens.GetData() + Next + Capacity - N;
+	}
+
+	/**
+	 * Returns the mirostat mu of this context for a mirostat version, initializing it from Tau on first use.
+	 * @param Version - The mirostat version (1 or 2)
+	 * @param Tau - The target entropy
+	 */
+	float& GetMirostatMu(int Version, float Tau)
+	{
+		const int Index = Version == 2 ? 1 : 0;
+		if (!bMirostatInitialized[Index])
+		{
+			MirostatMu[Index] = 2.0f * Tau;
+			bMirostatInitialized[Index] = true;
+		}
+		return MirostatMu[Index];
+	}
+
+	/** The position of the state at some point, cheap to take and to go back to */
+	struct FCheckpoint
+	{
+		int Next = 0;
+		int Count = 0;
+		int64 Added = 0;
+		float MirostatMu[2] = {0.f, 0.f};
+		bool bMirostatInitialized[2] = {false, false};
+	};
+
+	FCheckpoint MakeCheckpoint() const
+	{
+		FCheckpoint Checkpoint;
+		Checkpoint.Next = Next;
+		Checkpoint.Count = Count;
+		Checkpoint.Added = Added;
+		for (int i = 0; i < 2; i++)
+		{
+			Checkpoint.MirostatMu[i] = MirostatMu[i];
+			Checkpoint.bMirostatInitialized[i] = bMirostatInitialized[i];
+		}
+		return Checkpoint;
+	}
+
+	/**
+	 * Goes back to a checkpoint taken earlier. The mirostat state is always restored.
+	 * @return Whether the remembered tokens were restored too. They are not if the ring overwrote them since,
+	 * the token history is then empty and must be appended again by the caller.
+	 */
+	bool Restore(const FCheckpoint& Checkpoint)
+	{
+		for (int i = 0; i < 2; i++)
+		{
+			MirostatMu[i] = Checkpoint.MirostatMu[i];
+			bMirostatInitialized[i] = Checkpoint.bMirostatInitialized[i];
+		}
+
+		// The tokens of the checkpoint are still in the ring as long as fewer than Capacity - Count tokens were added since
+		const int64 AddedSince = Added - Checkpoint.Added;
+		if (AddedSince < 0 || AddedSince > Capacity - Checkpoint.Count)
+		{
+			Next = 0;
+			Count = 0;
+			return false;
+		}
+
+		Next = Checkpoint.Next;
+		Count = Checkpoint.Count;
+		return true;
+	}
+
+	/** Seeds the random draws made by the plugin's own sampling (see FLlamaSampler::SampleFromProbabilities) */
+	void SetSeed(uint32 Seed)
+	{
+		Rng.seed(Seed);
+	}
+
+	/** Returns a uniform draw in [0, 1) with 24 bits of resolution, the precision of a float probability */
+	float NextUniform()
+	{
+		return static_cast<float>(Rng() >> 8) * (1.0f / 16777216.0f);
+	}
+
+	/** Returns the candidate buffer of this context, grown to hold NVocab candidates if needed */
+	llama_token_data* GetCandidateBuffer(int NVocab)
+	{
+		if (Candidates.Num() < NVocab)
+		{
+			Candidates.SetNumUninitialized(NVocab);
+		}
+		return Candidates.GetData();
+	}
+
+	/** Reused buffer used to count the remembered tokens when applying penalties */
+	TArray<llama_token>& GetPenaltyScratch()
+	{
+		return PenaltyScratch;
+	}
+
+private:
+	/** Mirrored ring buffer of the remembered tokens */
+	TArray<llama_token> LastTokens;
+
+	int Capacity = 0;
+	int Next = 0;
+	int Count = 0;
+
+	/**
+	 * Number of tokens added since the capacity was set, to know which checkpoints the ring still covers.
+	 * Never decreases on Restore: what was written after the checkpoint still overwrote the ring.
+	 */
+	int64 Added = 0;
+
+	TArray<llama_token_data> Candidates;
+	TArray<llama_token> PenaltyScratch;
+
+	/** Random generator of the draws made outside llama, seeded with the seed of the context */
+	std::mt19937 Rng;
+
+	/** Mirostat v1 and v2 state */
+	float MirostatMu[2] = {0.f, 0.f};
+	bool bMirostatInitialized[2] = {false, false};
+};
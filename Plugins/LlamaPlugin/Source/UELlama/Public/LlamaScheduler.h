@@ -0,0 +1,112 @@
+﻿// Copyright 2023 Isara Technologies SAS. All Rights Reserved.
+
+#pragma once
+
+#include <atomic>
+
+#include "CoreMinimal.h"
+#include "HAL/Runnable.h"
+#include "HAL/ThreadSafeBool.h"
+
+class ULlamaContext;
+class FLlamaInferenceWorker;
+
+/**
+ * Runs inference requests on the plugin's own worker threads instead of the shared UE thread pool.
+ * Requests on the same context run one at a time, in submission order.
+ * Among the contexts that are free, the request with the highest priority runs first.
+ * At most MaxConcurrentEvals (see plugin settings) requests evaluate at the same time.
+ *
+ * When every evaluation slot is taken and a request with a higher priority is waiting, the running request
+ * with the lowest priority is asked to yield: at its next yield point (between two tokens or two prefill chunks)
+ * it gives its slot back and sleeps, its context untouched, until a slot is free again for its priority.
+ * A parked request keeps its thread, so a new worker is started whenever a slot is free and no worker is idle.
+ */
+class FLlamaScheduler
+{
+public:
+
+	/**
+	 * Queues some work for a context.
+	 * @param Context - The context the work runs on
+	 * @param Priority - Higher priorities run first
+	 * @param Work - The work to do on an inference thread
+	 */
+	static void Submit(ULlamaContext* Context, int32 Priority, TUniqueFunction<void()> Work);
+
+	/**
+	 * Called by a generation between two evaluations. Sleeps while a higher priority request uses the slot.
+	 * Does nothing outside of the scheduler threads.
+	 * @return False if the scheduler is shutting down or the request was cancelled, and the generation should stop
+	 */
+	static bool YieldPoint();
+
+	/** Stops the worker threads. Requests that did not start are dropped. Called on module shutdown. */
+	static void Shutdown();
+
+private:
+	friend class FLlamaInferenceWorker;
+
+	struct FRequest
+	{
+		ULlamaContext* Context = nullptr;
+		int32 Priority = 0;
+		TUniqueFunction<void()> Work;
+	};
+
+	/** A request that started on a worker thread */
+	struct FActiveRequest
+	{
+		ULlamaContext* Context = nullptr;
+		int32 Priority = 0;
+		std::atomic<bool> bYieldRequested { false };
+		bool bParked = false;
+		FEvent* ResumeEvent = nullptr;
+	};
+
+	/** Blocks until a request can run, or returns false when the scheduler stops */
+	static bool WaitForRequest(FRequest& OutRequest, FActiveRequest*& OutActive);
+
+	/** Frees the slot and the context of a finished request */
+	static void CompleteRequest(FActiveRequest* Active);
+
+	/** Hands free slots to parked requests, wakes workers for pending ones and asks for preemption. Requires Lock. */
+	static void Dispatch();
+
+	/** Index in Pending of the next request to run, INDEX_NONE if none can run. Requires Lock. */
+	static int32 PickRequest();
+
+	/** The parked request with the highest priority, null if none. Requires Lock. */
+	static FActiveRequest* PickParked();
+
+	static FCriticalSection Lock;
+	static TArray<FRequest> Pending;
+	static TArray<FActiveRequest*> Active;
+	static TSet<ULlamaContext*> BusyContexts;
+
+	/** Number of requests currently evaluating (started and not parked) */
+	static int32 Running;
+
+	/** Number of workers waiting for a request, or about to. Parked requests keep their worker busy. */
+	static int32 IdleWorkers;
+
+	static FEvent* WakeEvent;
+	static FThreadSafeBool bStopping;
+	static TArray<FLlamaInferenceWorker*> Workers;
+};
+
+/** A thread running scheduler requests */
+class FLlamaInferenceWorker : public FRunnable
+{
+public:
+	explicit FLlamaInferenceWorker(int32 Index);
+	virtual ~FLlamaInferenceWorker() override;
+
+	virtual uint32 Run() override;
+
+	/** Waits for the thread to exit */
+	void Join();
+
+private:
+	FRunnableThread* Thread = nullptr;
+};
@@ -22,6 +22,43 @@ public:
 	UPROPERTY(config, EditAnywhere, Category = ContextConfiguration)
 	int NThreadToUse;
 
+	/** The number of prompt tokens evaluated per llama_eval call during prefill */
+	UPROPERTY(config, EditAnywhere, Category = ContextConfiguration, meta = (ClampMin = "1"))
+	int BatchSize;
+
+	/** The maximum number of requests evaluated at the same time, each on its own inference thread */
+	UPROPERTY(config, EditAnywhere, Category = ContextConfiguration, meta = (ClampMin = "1"))
+	int MaxConcurrentEvals;
+
+	/**
+	 * The number of contexts each model can have (0 for no limit and no pool). Freed contexts go back to the pool
+	 * with their KV cache still allocated, and new contexts are taken from it, so spawning an NPC allocates nothing.
+	 */
+	UPROPERTY(config, EditAnywhere, Category = ContextConfiguration, meta = (ClampMin = "0"))
+	int ContextPoolSize;
+
+	/**
+	 * The RAM the compressed KV caches of suspended contexts may use, in MB. Above it, the least recently used ones are moved to disk.
+	 * When the context pool is exhausted, the least recently used idle context is suspended to make room.
+	 */
+	UPROPERTY(config, EditAnywhere, Category = ContextConfiguration, meta = (ClampMin = "0"))
+	int SuspendedContextsRamMB;
+
+	/** The memory the loaded models may use together, in MB (0 for no limit). Models no context uses are unloaded, least recently used first. */
+	UPROPERTY(config, EditAnywhere, Category = ModelConfiguration, meta = (ClampMin = "0"))
+	int ModelMemoryBudgetMB;
+
+	/** Editor only: keeps the loaded models in memory when a Play In Editor session ends, so the next one does not load them again. Contexts are still freed. */
+	UPROPERTY(config, EditAnywhere, Category = ModelConfiguration)
+	bool bKeepModelsAcrossPIE;
+
+	/**
+	 * The folder of the model files, relative to the project. Its .gguf files are staged uncompressed beside the packaged game
+	 * (outside of the pak files) so they can be memory mapped. Model paths that are not found are looked for in this folder.
+	 */
+	UPROPERTY(config, EditAnywhere, Category = ModelConfiguration)
+	FString ModelDirectory;
+
 	void Reset();
 
 	/** General settings of the plugin retrieved from configuration window */
@@ -0,0 +1,73 @@
+﻿// Copyright 2023 Isara Technologies SAS. All Rights Reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "llama.h"
+#include "LlamaSampler.h"
+
+class ULlamaContext;
+
+/**
+ * Speculative decoding: the next tokens of an answer are proposed, the model evaluates them all at once
+ * and keeps the longest run it agrees with, followed by one token of its own.
+ * Tokens are proposed by a small draft model, or copied from the conversation where its last tokens already appeared (prompt lookup).
+ * A proposed token is accepted with probability min(1, p / q), where p and q are the probabilities the model and the proposer
+ * give it after the request's sampling stages (q = 1 for a copied token), and a rejected one is replaced by a token drawn from max(0, p - q).
+ * The answer is thus distributed exactly as if the model had sampled it alone, one evaluation per token.
+ */
+class FLlamaSpeculation
+{
+public:
+
+	/**
+	 * Whether a request can use speculative decoding on a context: its model must have a draft model or allow prompt lookup,
+	 * and mirostat, which updates its state after every token, is not supported.
+	 * @param Context - The context the request runs on
+	 * @param Chain - The sampling stages of the request
+	 * @param NDraft - The number of tokens the request wants proposed per step
+	 * @param bPromptLookup - Whether the request wants tokens proposed by prompt lookup
+	 */
+	static bool CanSpeculate(const ULlamaContext* Context, const FLlamaSamplerChain& Chain, int NDraft, bool bPromptLookup);
+
+	/**
+	 * Proposes up to NDraft tokens, checks them in one evaluation of the model, and adds the accepted ones
+	 * to the history followed by a token sampled from the model. Requires the write lock.
+	 * The last added token is not evaluated yet: the next step evaluates it with its proposals, Finish at the end of the answer.
+	 * @param Context - The context to generate on
+	 * @param Chain - The sampling stages of the request
+	 * @param NDraft - The maximum number of proposed tokens
+	 * @param bPromptLookup - Whether to look for proposals in the history first, before asking the draft model (if any)
+	 * @param MaxTokens - The maximum number of tokens to add, at least 1
+	 * @param OutTokens - Receives the added tokens. The last one may be the end of stream token.
+	 * @return False if an evaluation failed
+	 */
+	static bool Step(ULlamaContext* Context, const FLlamaSamplerChain& Chain, int NDraft, bool bPromptLookup, int MaxTokens, TArray<llama_token>& OutTokens);
+
+	/** Evaluates the last token added by Step, so the KV cache holds the whole history again. Requires the write lock. */
+	static bool Finish(ULlamaContext* Context);
+
+private:
+
+	/** Creates the draft context if needed, then evaluates the part of the history its KV cache does not hold */
+	static bool SyncDraft(ULlamaContext* Context);
+
+	/**
+	 * Samples up to NDraft tokens from the draft model after the history, with the sampling stages of the request.
+	 * @param Context - The context to propose tokens for, its draft context in sync with its history
+	 * @param Chain - The sampling stages of the request
+	 * @param NDraft - The maximum number of proposed tokens
+	 * @param OutProposals - Receives the proposed tokens
+	 * @param OutProbs - Receives the distribution each proposal was drawn from, NVocab floats per proposal (not with a greedy chain)
+	 */
+	static void Propose(ULlamaContext* Context, const FLlamaSamplerChain& Chain, int NDraft, TArray<llama_token>& OutProposals, TArray<float>& OutProbs);
+
+	/**
+	 * Finds the most recent earlier occurrence of the last tokens of the history, longest match first,
+	 * and proposes the tokens that followed it.
+	 * @param Context - The context to propose tokens for
+	 * @param NDraft - The maximum number of proposed tokens
+	 * @param OutProposals - Receives the proposed tokens, none if the last tokens never appeared before
+	 */
+	static void LookUp(const ULlamaContext* Context, int NDraft, TArray<llama_token>& OutProposals);
+};
@@ -0,0 +1,80 @@
+﻿// Copyright 2023 Isara Technologies SAS. All Rights Reserved.
+
+#pragma once
+
+#include <atomic>
+
+#include "CoreMinimal.h"
+#include "Containers/Queue.h"
+#include "Containers/Ticker.h"
+#include "LlamaRunner.h"
+
+/**
+ * The tokens of one streamed answer, on their way from the inference thread to the game thread.
+ * The inference thread pushes into a lock-free single producer / single consumer queue,
+ * the game thread drains it once per frame and calls the request's delegate at most once with everything received.
+ * The queue is unbounded: a generation holding the context lock never waits for a game thread that may be waiting for that lock.
+ */
+class FLlamaStream
+{
+public:
+	explicit FLlamaStream(const FLlamaStreamDelegate& InStreamCallback);
+	explicit FLlamaStream(const FLlamaRequestCallDelegate& InAnswerCallback);
+
+	/** Producer side: queues the text of a token. Never blocks. */
+	void Push(FString Delta, llama_token Token);
+
+	/** Producer side: no more tokens will be pushed */
+	void Finish();
+
+	/**
+	 * Consumer side (game thread): delivers everything pushed since the last call.
+	 * @return Whether the stream is finished and fully delivered
+	 */
+	bool Drain();
+
+private:
+	struct FEntry
+	{
+		FString Delta;
+		int32 Token = 0;
+	};
+
+	TQueue<FEntry, EQueueMode::Spsc> Queue;
+	std::atomic<bool> bFinished { false };
+
+	FLlamaStreamDelegate StreamCallback;
+	FLlamaRequestCallDelegate AnswerCallback;
+
+	/** Game thread side: the answer delivered so far and the tokens not delivered yet */
+	FString Answer;
+	TArray<int32> PendingTokens;
+};
+
+/** Drains every registered FLlamaStream once per frame on the game thread. */
+class FLlamaStreamDispatcher
+{
+public:
+	/** Starts ticking. Called on module startup. */
+	static void Startup();
+
+	/** Stops ticking and drops undelivered streams. Called on module shutdown. */
+	static void Shutdown();
+
+	/** Adds a stream to drain every frame until it is finished. Can be called from any thread. */
+	static void Register(const TSharedRef<FLlamaStream, ESPMode::ThreadSafe>& Stream);
+
+	/**
+	 * Runs a function on the game thread during the next dispatch, after the streams have been drained.
+	 * Can be called from any thread.
+	 */
+	static void RunOnGameThread(TUniqueFunction<void()> Task);
+
+private:
+	static bool Tick(float DeltaTime);
+
+	static FCriticalSection StreamsLock;
+	static TArray<TSharedRef<FLlamaStream, ESPMode::ThreadSafe>> Streams;
+	static FTSTicker::FDelegateHandle TickerHandle;
+	static TQueue<TUniqueFunction<void()>, EQueueMode::Mpsc> GameThreadTasks;
+};
@@ -0,0 +1,130 @@
+﻿// Copyright 2023 Isara Technologies SAS. All Rights Reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "llama.h"
+
+/**
+ * The tokens currently held in a context's KV cache, in evaluation order.
+ * The first tokens (the persona prefix) can be pinned: they are stored apart and never discarded.
+ * The rest of the history lives in a ring buffer so that dropping the oldest tokens does not move memory.
+ */
+class FLlamaTokenHistory
+{
+public:
+
+	/** Sets the maximum number of tokens (pinned + unpinned) the history can hold and clears it */
+	void SetCapacity(int InCapacity)
+	{
+		Capacity = FMath::Max(0, InCapacity);
+		Ring.SetNumZeroed(Capacity);
+		Reset();
+	}
+
+	int GetCapacity() const
+	{
+		return Capacity;
+	}
+
+	/** Removes every token, pinned ones included */
+	void Reset()
+	{
+		Keep.Reset();
+		Head = 0;
+		Count = 0;
+	}
+
+	int Num() const
+	{
+		return Keep.Num() + Count;
+	}
+
+	/** Number of pinned tokens at the start of the history */
+	int GetKeep() const
+	{
+		return Keep.Num();
+	}
+
+	llama_token operator[](int Index) const
+	{
+		check(Index >= 0 && Index < Num());
+		if (Index < Keep.Num())
+		{
+			return Keep[Index];
+		}
+		return Ring[(Head + Index - Keep.Num()) % Capacity];
+	}
+
+	llama_token Last() const
+	{
+		return (*this)[Num() - 1];
+	}
+
+	void Add(llama_token Token)
+	{
+		check(Num() < Capacity);
+		Ring[(Head + Count) % Capacity] = Token;
+		Count++;
+	}
+
+	void Append(const llama_token* Tokens, int NTokens)
+	{
+		for (int i = 0; i < NTokens; i++)
+		{
+			Add(Tokens[i]);
+		}
+	}
+
+	void Append(const TArray<llama_token>& Tokens)
+	{
+		Append(Tokens.GetData(), Tokens.Num());
+	}
+
+	/** Pins the first NKeep tokens of the history. Pinned tokens can't be unpinned except by Reset. */
+	void Pin(int NKeep)
+	{
+		NKeep = FMath::Min(NKeep, Num());
+		while (Keep.Num() < NKeep)
+		{
+			Keep.Add(Ring[Head]);
+			Head = (Head + 1) % Capacity;
+			Count--;
+		}
+	}
+
+	/** Drops the NDiscard oldest unpinned tokens */
+	void DiscardOldest(int NDiscard)
+	{
+		NDiscard = FMath::Clamp(NDiscard, 0, Count);
+		Head = (Head + NDiscard) % Capacity;
+		Count -= NDiscard;
+	}
+
+	/** Drops every token from index NewNum onward. Pinned tokens are kept. */
+	void Truncate(int NewNum)
+	{
+		Count = FMath::Clamp(NewNum - Keep.Num(), 0, Count);
+	}
+
+	/** Copies the tokens in [From, Num()) into Out, replacing its content */
+	void CopyTail(int From, TArray<llama_token>& Out) const
+	{
+		Out.Reset();
+		for (int i = FMath::Max(0, From); i < Num(); i++)
+		{
+			Out.Add((*this)[i]);
+		}
+	}
+
+private:
+	/** Pinned tokens, never discarded when the window shifts */
+	TArray<llama_token> Keep;
+
+	/** Unpinned tokens, Count of them starting at Head */
+	TArray<llama_token> Ring;
+
+	int Capacity = 0;
+	int Head = 0;
+	int Count = 0;
+};
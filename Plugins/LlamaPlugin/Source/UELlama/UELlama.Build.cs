@@ -1,6 +1,7 @@
 // Copyright 2023 Isara Technologies SAS. All Rights Reserved.
 
 using System.IO;
+using EpicGames.Core;
 using UnrealBuildTool;
 
 public class UELlama : ModuleRules
@@ -50,6 +51,25 @@ public class UELlama : ModuleRules
 		return isLibrarySupported;
 	}
 
+	// Models are staged as loose files beside the game: a file inside a compressed pak cannot be memory mapped by llama
+	public void StageModels(ReadOnlyTargetRules Target)
+	{
+		if (Target.ProjectFile == null)
+		{
+			return;
+		}
+
+		string ModelDirectory = "Models";
+		ConfigHierarchy EngineIni = ConfigCache.ReadHierarchy(ConfigHierarchyType.Engine, Target.ProjectFile.Directory, Target.Platform);
+		EngineIni.GetString("/Script/UELlama.LlamaSettings", "ModelDirectory", out ModelDirectory);
+		if (string.IsNullOrEmpty(ModelDirectory))
+		{
+			ModelDirectory = "Models";
+		}
+
+		RuntimeDependencies.Add(Path.Combine("$(ProjectDir)", ModelDirectory, "*.gguf"), StagedFileType.NonUFS);
+	}
+
 	public UELlama(ReadOnlyTargetRules Target) : base(Target)
 	{
 		PCHUsage = PCHUsageMode.UseExplicitOrSharedPCHs;
@@ -92,5 +112,6 @@ public class UELlama : ModuleRules
 		PublicIncludePaths.Add(Path.Combine(ModuleDirectory, "Public"));
 
 		LoadLlama(Target);
+		StageModels(Target);
 	}
 }
@@ -8,6 +8,7 @@ UProgressiveStringSplitterBPLibrary::UProgressiveStringSplitterBPLibrary(const F
 : Super(ObjectInitializer)
 {
 	ProcessedString = TEXT("");
+	PendingString = TEXT("");
 }
 
 UProgressiveStringSplitterBPLibrary* UProgressiveStringSplitterBPLibrary::CreateSplitter()
@@ -18,6 +19,7 @@ UProgressiveStringSplitterBPLibrary* UProgressiveStringSplitterBPLibrary::Create
 void UProgressiveStringSplitterBPLibrary::ResetSplitter()
 {
 	ProcessedString = TEXT("");
+	PendingString = TEXT("");
 }
 
 TArray<FString> UProgressiveStringSplitterBPLibrary::Split(const FString& Progressive)
@@ -148,6 +150,27 @@ FString UProgressiveStringSplitterBPLibrary::WindUp(const FString& FinalString)
 	return FinalString.RightChop(len).TrimStartAndEnd();
 }
 
+TArray<FString> UProgressiveStringSplitterBPLibrary::SplitDelta(const FString& Delta)
+{
+	// Only the unsplit tail is kept, so each call works on the current sentence instead of the whole answer
+	PendingString += Delta;
+	ProcessedString = TEXT("");
+
+	TArray<FString> ret = Split(PendingString);
+
+	PendingString.RightChopInline(ProcessedString.Len());
+	ProcessedString = TEXT("");
+	return ret;
+}
+
+FString UProgressiveStringSplitterBPLibrary::WindUpDelta()
+{
+	FString ret = PendingString.TrimStartAndEnd();
+	PendingString = TEXT("");
+	ProcessedString = TEXT("");
+	return ret;
+}
+
 bool UProgressiveStringSplitterBPLibrary::RegexCanMatch(const FString& pattern, const FString& input)
 {
 	const FRegexPattern frp = FRegexPattern(pattern);
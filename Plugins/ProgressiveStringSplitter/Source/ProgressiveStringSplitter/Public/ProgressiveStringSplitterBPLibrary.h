@@ -66,6 +66,14 @@ public:
 	UFUNCTION(BlueprintCallable, Category = "Progressive String Splitter")
 	FString WindUp(const FString& FinalString);
 
+	/*Same as Split, but takes only the text added since the last call instead of the whole growing string. Don't mix with Split on the same splitter*/
+	UFUNCTION(BlueprintCallable, Category = "Progressive String Splitter")
+	TArray<FString> SplitDelta(const FString& Delta);
+
+	/*Returns the text received through SplitDelta that was not split yet and resets the splitter*/
+	UFUNCTION(BlueprintCallable, Category = "Progressive String Splitter")
+	FString WindUpDelta();
+
 	/*Indicates whether a pattern can be matched at least once in the input string*/
 	UFUNCTION(BlueprintCallable, Category = "Progressive String Splitter")
 	static bool RegexCanMatch(const FString& pattern, const FString& input);
@@ -80,4 +88,7 @@ public:
 
 private:
 	FString ProcessedString;
+
+	/*Text received through SplitDelta and not split yet*/
+	FString PendingString;
 };